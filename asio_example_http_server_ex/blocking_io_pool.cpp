@@ -0,0 +1,54 @@
+#include "blocking_io_pool.hpp"
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace timax
+{
+	blocking_io_pool& blocking_io_pool::instance()
+	{
+		// never destroyed, the threads run until the process exits
+		static blocking_io_pool* pool = new blocking_io_pool;
+		return *pool;
+	}
+
+	blocking_io_pool::blocking_io_pool()
+		: work_(new boost::asio::io_service::work(io_service_))
+	{
+	}
+
+	void blocking_io_pool::set_threads(std::size_t threads)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (!started_)
+		{
+			threads_ = threads;
+		}
+	}
+
+	void blocking_io_pool::set_min_async_size(uint64_t size)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		min_async_size_ = size;
+	}
+
+	bool blocking_io_pool::use_for(uint64_t size) const
+	{
+		return threads_ != 0 && size >= min_async_size_;
+	}
+
+	void blocking_io_pool::start()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (started_)
+		{
+			return;
+		}
+
+		started_ = true;
+		for (std::size_t i = 0; i < threads_; ++i)
+		{
+			boost::thread([this] { io_service_.run(); }).detach();
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdint>
+
+namespace timax
+{
+	/// Threads for blocking calls such as disk reads, which must not stall the io_service threads.
+	/// Work is queued on a single io_service run by all threads of the pool.
+	class blocking_io_pool
+		: private boost::noncopyable
+	{
+	public:
+		static blocking_io_pool& instance();
+
+		/// Set before serving, the threads are started on first use.
+		/// With 0 threads everything runs on the calling io_service thread.
+		void set_threads(std::size_t threads);
+
+		/// File bodies smaller than this are read on the io_service thread, a page cache hit
+		/// is cheaper than the hop to the pool and back.
+		void set_min_async_size(uint64_t size);
+
+		/// Whether a file body of size bytes should be read on the pool.
+		bool use_for(uint64_t size) const;
+
+		/// Run handler on one of the pool threads.
+		template<typename Handler>
+		void post(Handler handler)
+		{
+			start();
+			io_service_.post(std::move(handler));
+		}
+
+	private:
+		blocking_io_pool();
+
+		void start();
+
+		boost::asio::io_service io_service_;
+		boost::shared_ptr<boost::asio::io_service::work> work_;
+
+		boost::mutex mutex_;
+		bool started_ = false;
+		std::size_t threads_ = 4;
+		uint64_t min_async_size_ = 64 * 1024;
+	};
+}
@@ -0,0 +1,302 @@
+#include "compression.hpp"
+#include "utils.h"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+namespace timax
+{
+	namespace compression
+	{
+		config_t& config()
+		{
+			static config_t cfg;
+			return cfg;
+		}
+
+		const char* coding_name(coding_t coding)
+		{
+			switch (coding)
+			{
+			case gzip:
+				return "gzip";
+			case deflate:
+				return "deflate";
+			default:
+				return "identity";
+			}
+		}
+
+		bool is_compressible(boost::string_ref content_type)
+		{
+			auto pos = content_type.find(';');
+			if (pos != boost::string_ref::npos)
+			{
+				content_type = content_type.substr(0, pos);
+			}
+			while (!content_type.empty() && content_type.back() == ' ')
+			{
+				content_type.remove_suffix(1);
+			}
+
+			auto istarts_with = [&content_type](const char* prefix, std::size_t len)
+			{
+				return content_type.size() >= len && iequal(content_type.data(), len, prefix, len);
+			};
+			auto iends_with = [&content_type](const char* suffix, std::size_t len)
+			{
+				return content_type.size() >= len && iequal(content_type.data() + content_type.size() - len, len, suffix, len);
+			};
+
+			return istarts_with("text/", 5)
+				|| iequal(content_type.data(), content_type.size(), "application/json", 16)
+				|| iequal(content_type.data(), content_type.size(), "application/javascript", 22)
+				|| iequal(content_type.data(), content_type.size(), "application/x-javascript", 24)
+				|| iequal(content_type.data(), content_type.size(), "application/xml", 15)
+				|| iequal(content_type.data(), content_type.size(), "image/svg+xml", 13)
+				|| iends_with("+json", 5)
+				|| iends_with("+xml", 4);
+		}
+
+		deflate_stream::deflate_stream(int window_bits, int level, int mem_level)
+		{
+			std::memset(&zs_, 0, sizeof(zs_));
+			ok_ = deflateInit2(&zs_, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY) == Z_OK;
+		}
+
+		deflate_stream::~deflate_stream()
+		{
+			if (ok_)
+			{
+				deflateEnd(&zs_);
+			}
+		}
+
+		boost::shared_ptr<deflate_stream> deflate_stream::create(coding_t coding, int level)
+		{
+			// HTTP的deflate是带zlib头的格式, gzip在窗口位数上加16
+			return boost::make_shared<deflate_stream>(coding == gzip ? 15 + 16 : 15, level);
+		}
+
+		bool deflate_stream::write(const void* data, std::size_t size, int flush, std::string& out)
+		{
+			if (!ok_)
+			{
+				return false;
+			}
+
+			zs_.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+			zs_.avail_in = static_cast<uInt>(size);
+			for (;;)
+			{
+				auto old_size = out.size();
+				std::size_t chunk = std::max<std::size_t>(size / 2 + 64, 4096);
+				out.resize(old_size + chunk);
+				zs_.next_out = reinterpret_cast<Bytef*>(&out[old_size]);
+				zs_.avail_out = static_cast<uInt>(chunk);
+
+				auto ret = ::deflate(&zs_, flush);
+				out.resize(old_size + chunk - zs_.avail_out);
+				if (ret == Z_STREAM_ERROR)
+				{
+					return false;
+				}
+				if (ret == Z_STREAM_END || ret == Z_BUF_ERROR || (zs_.avail_out != 0 && zs_.avail_in == 0))
+				{
+					return true;
+				}
+			}
+		}
+
+		void deflate_stream::reset()
+		{
+			if (ok_)
+			{
+				deflateReset(&zs_);
+			}
+		}
+
+		inflate_stream::inflate_stream(int window_bits)
+		{
+			std::memset(&zs_, 0, sizeof(zs_));
+			ok_ = inflateInit2(&zs_, window_bits) == Z_OK;
+		}
+
+		inflate_stream::~inflate_stream()
+		{
+			if (ok_)
+			{
+				inflateEnd(&zs_);
+			}
+		}
+
+		bool inflate_stream::write(const void* data, std::size_t size, std::string& out, std::size_t max_size)
+		{
+			if (!ok_)
+			{
+				return false;
+			}
+
+			zs_.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+			zs_.avail_in = static_cast<uInt>(size);
+			for (;;)
+			{
+				auto old_size = out.size();
+				std::size_t chunk = std::max<std::size_t>(size * 4, 4096);
+				out.resize(old_size + chunk);
+				zs_.next_out = reinterpret_cast<Bytef*>(&out[old_size]);
+				zs_.avail_out = static_cast<uInt>(chunk);
+
+				auto ret = ::inflate(&zs_, Z_SYNC_FLUSH);
+				out.resize(old_size + chunk - zs_.avail_out);
+				if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+				{
+					return false;
+				}
+				if (out.size() > max_size)
+				{
+					return false;
+				}
+				if (ret == Z_STREAM_END || ret == Z_BUF_ERROR || (zs_.avail_out != 0 && zs_.avail_in == 0))
+				{
+					return true;
+				}
+			}
+		}
+
+		void inflate_stream::reset()
+		{
+			if (ok_)
+			{
+				inflateReset(&zs_);
+			}
+		}
+
+		namespace
+		{
+			class compressed_cache
+			{
+			public:
+				boost::shared_ptr<std::string const> get(std::size_t hash, std::string const& body, coding_t coding, int level)
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					auto it = find(hash, body, coding, level);
+					if (it == lru_.end())
+					{
+						return{};
+					}
+
+					lru_.splice(lru_.begin(), lru_, it);
+					return it->compressed;
+				}
+
+				void put(std::size_t hash, std::string const& body, coding_t coding, int level,
+					boost::shared_ptr<std::string const> compressed, std::size_t capacity)
+				{
+					auto size = body.size() + compressed->size();
+					if (size > capacity)
+					{
+						return;
+					}
+
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					if (find(hash, body, coding, level) != lru_.end())
+					{
+						return;
+					}
+
+					lru_.push_front(entry_t{ hash, coding, level, body, std::move(compressed) });
+					index_.emplace(hash, lru_.begin());
+					bytes_ += size;
+
+					while (bytes_ > capacity)
+					{
+						auto& last = lru_.back();
+						auto range = index_.equal_range(last.hash);
+						for (auto it = range.first; it != range.second; ++it)
+						{
+							if (&*it->second == &last)
+							{
+								index_.erase(it);
+								break;
+							}
+						}
+						bytes_ -= last.original.size() + last.compressed->size();
+						lru_.pop_back();
+					}
+				}
+
+			private:
+				struct entry_t
+				{
+					std::size_t hash;
+					coding_t coding;
+					int level;
+					// 保留原文比较, 哈希冲突时不会返回别的body
+					std::string original;
+					boost::shared_ptr<std::string const> compressed;
+				};
+
+				std::list<entry_t>::iterator find(std::size_t hash, std::string const& body, coding_t coding, int level)
+				{
+					auto range = index_.equal_range(hash);
+					for (auto it = range.first; it != range.second; ++it)
+					{
+						auto& entry = *it->second;
+						if (entry.coding == coding && entry.level == level && entry.original == body)
+						{
+							return it->second;
+						}
+					}
+					return lru_.end();
+				}
+
+				boost::mutex mutex_;
+				std::list<entry_t> lru_;
+				std::unordered_multimap<std::size_t, std::list<entry_t>::iterator> index_;
+				std::size_t bytes_ = 0;
+			};
+
+			compressed_cache& cache()
+			{
+				static compressed_cache* c = new compressed_cache;
+				return *c;
+			}
+		}
+
+		boost::shared_ptr<std::string const> compress_cached(std::string const& body, coding_t coding)
+		{
+			auto const& cfg = config();
+			bool cacheable = cfg.cache_size != 0 && body.size() <= cfg.max_cached_body;
+			std::size_t hash = 0;
+			if (cacheable)
+			{
+				hash = std::hash<std::string>()(body);
+				auto hit = cache().get(hash, body, coding, cfg.level);
+				if (hit)
+				{
+					return hit;
+				}
+			}
+
+			auto compressed = boost::make_shared<std::string>();
+			if (!deflate_stream::create(coding, cfg.level)->write(body.data(), body.size(), Z_FINISH, *compressed))
+			{
+				return{};
+			}
+
+			if (cacheable)
+			{
+				cache().put(hash, body, coding, cfg.level, compressed, cfg.cache_size);
+			}
+			return compressed;
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <cstddef>
+#include <string>
+
+#include <zlib.h>
+
+namespace timax
+{
+	namespace compression
+	{
+		enum coding_t
+		{
+			identity,
+			gzip,
+			deflate
+		};
+
+		struct config_t
+		{
+			bool enabled = true;
+			// zlib level, 1 (fastest) - 9 (best)
+			int level = 6;
+			// string bodies smaller than this are sent as is
+			std::size_t min_size = 1024;
+			// bytes of original plus compressed string bodies kept for reuse, 0 disables the cache
+			std::size_t cache_size = 8 * 1024 * 1024;
+			// bodies larger than this are never cached
+			std::size_t max_cached_body = 1024 * 1024;
+		};
+
+		// set before the server starts
+		config_t& config();
+
+		const char* coding_name(coding_t coding);
+		bool is_compressible(boost::string_ref content_type);
+
+		// zlib deflate, window_bits as for deflateInit2: 9..15 zlib, 25..31 gzip, -9..-15 raw
+		class deflate_stream
+			: private boost::noncopyable
+		{
+		public:
+			deflate_stream(int window_bits, int level, int mem_level = 8);
+			~deflate_stream();
+
+			static boost::shared_ptr<deflate_stream> create(coding_t coding, int level);
+
+			// append the compressed bytes of data to out, flush is Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+			bool write(const void* data, std::size_t size, int flush, std::string& out);
+
+			void reset();
+
+		private:
+			z_stream zs_;
+			bool ok_;
+		};
+
+		// inflate, window_bits as for inflateInit2
+		class inflate_stream
+			: private boost::noncopyable
+		{
+		public:
+			explicit inflate_stream(int window_bits);
+			~inflate_stream();
+
+			// append the inflated bytes of data to out, fails when out would grow beyond max_size
+			bool write(const void* data, std::size_t size, std::string& out, std::size_t max_size);
+
+			void reset();
+
+		private:
+			z_stream zs_;
+			bool ok_;
+		};
+
+		// compress body in one go, results are kept in a bounded LRU cache keyed by content hash
+		boost::shared_ptr<std::string const> compress_cached(std::string const& body, coding_t coding);
+	}
+}
@@ -3,6 +3,8 @@
 
 #include "reply.hpp"
 #include "request.hpp"
+#include "http2.hpp"
+#include "memory_report.hpp"
 #include "utils.h"
 
 #include <boost/bind.hpp>
@@ -16,14 +18,14 @@
 #include <boost/make_shared.hpp>
 #include <boost/enable_shared_from_this.hpp>
 
+#include <atomic>
+#include <type_traits>
 #include <vector>
 
 #include <cassert>
 
 namespace timax
 {
-	using request_handler_t = boost::function<void(const request& req, reply& rep)>;
-
 	template <typename socket_type>
 	class connection
 		: public boost::enable_shared_from_this<connection<socket_type>>,
@@ -31,15 +33,31 @@ namespace timax
 	{
 	public:
 		explicit connection(boost::asio::io_service& io_service, request_handler_t& handler)
-			: socket_(io_service), request_handler_(handler), deadline_(io_service)
+			: io_service_(&io_service), socket_(io_service), request_handler_(handler), deadline_(io_service)
 		{
 			request_.raw_request().size = 0;
+			memory_report::connection_opened(is_tls);
 		}
 
 		explicit connection(boost::asio::io_service& io_service, request_handler_t& handler, boost::asio::ssl::context& ctx)
-			: socket_(io_service, ctx), request_handler_(handler), deadline_(io_service)
+			: io_service_(&io_service), socket_(io_service, ctx), request_handler_(handler), deadline_(io_service)
 		{
 			request_.raw_request().size = 0;
+			memory_report::connection_opened(is_tls);
+		}
+
+		~connection()
+		{
+			keep_session(socket_);
+			if (parked_)
+			{
+				memory_report::connection_parked(false);
+			}
+			if (http2_)
+			{
+				memory_report::http2_closed();
+			}
+			memory_report::connection_closed(is_tls);
 		}
 
 		socket_type&  socket()
@@ -87,9 +105,11 @@ namespace timax
 							return;
 						}
 
-						request_.raw_request().size = 0;
-						do_read();
-					}
+						wait_next_request();
+					},
+
+					is_tls ? reply::migrate_func_t() : [self, this](boost::asio::io_service& to) {return migrate(socket_, to);},
+					*io_service_
 				);
 			});
 
@@ -97,13 +117,101 @@ namespace timax
 			do_read();
 		}
 
+		// ALPNѡh2, h2cprefaceͷ(dataѾĲ). ֻ֮HTTP/2
+		void start_http2(const char* data, std::size_t length)
+		{
+			boost::weak_ptr<connection<socket_type>> weak_self = this->shared_from_this();
+			http2_ = boost::make_shared<http2::session>(*io_service_, request_handler_,
+				[weak_self](boost::asio::const_buffer buffer, reply::handler_ec_t handler)
+				{
+					auto self = weak_self.lock();
+					if (!self)
+					{
+						return;
+					}
+
+					self->reset_timer();
+					boost::asio::async_write(self->socket_, boost::asio::buffer(buffer),
+						[self, handler](boost::system::error_code const& ec, std::size_t)
+					{
+						handler(ec);
+					});
+				},
+				[weak_self]()
+				{
+					auto self = weak_self.lock();
+					if (self)
+					{
+						self->close();
+					}
+				},
+				this->shared_from_this());
+			memory_report::http2_started();
+
+			http2_buf_.resize(16384);
+			http2_->start(data, length);
+			do_read_http2();
+		}
+
+		// TLShandshake_pool߳н, ɺsocketصԼio_service, handler.
+		// socketƶʱ͵
+		void handshake_on(boost::asio::io_service& ios, boost::function<void(boost::system::error_code const&)> handler)
+		{
+			auto self = this->shared_from_this();
+			bool moved = move_socket(socket_.next_layer(), ios);
+
+			// ڼĳʱsocketͬһio_service, ֲ
+			auto timer = boost::make_shared<boost::asio::deadline_timer>(moved ? ios : *io_service_);
+			timer->expires_from_now(boost::posix_time::seconds(60));
+			timer->async_wait([self, this](boost::system::error_code const& ec)
+			{
+				if (!ec)
+				{
+					close();
+				}
+			});
+
+			socket_.async_handshake(boost::asio::ssl::stream_base::server,
+				[self, this, moved, timer, handler](boost::system::error_code ec)
+			{
+				boost::system::error_code ignored_ec;
+				timer->cancel(ignored_ec);
+				if (moved && !move_socket(socket_.next_layer(), *io_service_))
+				{
+					close();
+					ec = boost::asio::error::operation_aborted;
+				}
+				io_service_.load()->post([handler, ec] { handler(ec); });
+			});
+		}
+
 		void close()
 		{
 			do_close(socket_);
 		}
 
+		// ռõڴ, ӵio߳е
+		memory_report::usage_t memory_usage() const
+		{
+			memory_report::usage_t usage;
+			usage.request = request_.raw_request().max_size;
+			usage.reply = reply_.memory_usage();
+			for (auto& write : delay_writes_)
+			{
+				usage.reply += write.buffers.capacity() * sizeof(boost::asio::const_buffer);
+			}
+			usage.read_buffer = chunked_buf_.capacity() + http2_buf_.capacity();
+			usage.tls = tls_memory(socket_);
+			usage.parked = parked_;
+			return usage;
+		}
+
 		void reset_timer(int seconds = 60)
 		{
+			if (upgraded_)
+			{
+				return;
+			}
 			deadline_.expires_from_now(boost::posix_time::seconds(seconds));	//TODO:ʱʱΪ
 			boost::weak_ptr<connection<socket_type>> weak_self = this->shared_from_this();
 
@@ -121,6 +229,19 @@ namespace timax
 		}
 
 	private:
+		void keep_session(boost::asio::ip::tcp::socket const&)
+		{
+		}
+		// ǲclose_notify͹ر, OpenSSLͷʱΪỰ, ӻɾ
+		void keep_session(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& s)
+		{
+			auto ssl = s.native_handle();
+			if (SSL_is_init_finished(ssl))
+			{
+				SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+			}
+		}
+
 		void do_close(boost::asio::ip::tcp::socket const&)
 		{
 			boost::system::error_code ec;
@@ -132,6 +253,122 @@ namespace timax
 			socket_.lowest_layer().close(ec);
 		}
 
+		// releaseȡ, toassign. ڽеĲoperation_aborted
+		static bool move_socket(boost::asio::ip::tcp::socket& s, boost::asio::io_service& to)
+		{
+			boost::system::error_code ec;
+			auto protocol = s.local_endpoint(ec).protocol();
+			if (ec)
+			{
+				return false;
+			}
+
+			auto handle = s.release(ec);
+			if (ec)
+			{
+				return false;
+			}
+
+			boost::asio::ip::tcp::socket moved(to);
+			moved.assign(protocol, handle, ec);
+			if (ec)
+			{
+				// Żȥ, socketԭio_service
+				s.assign(protocol, handle, ec);
+				return false;
+			}
+			s = std::move(moved);
+			return true;
+		}
+
+		bool migrate(boost::asio::ip::tcp::socket const&, boost::asio::io_service& to)
+		{
+			if (delay_writing_ || !delay_writes_.empty() || !move_socket(socket_, to))
+			{
+				return false;
+			}
+
+			// ȴеĳʱoperation_aborted, ´ζʱµio_service¼ʱ
+			boost::system::error_code ec;
+			deadline_.cancel(ec);
+			deadline_ = boost::asio::deadline_timer(to);
+			io_service_ = &to;
+			return true;
+		}
+		// TLS״̬SSLĻ, Ǩ
+		bool migrate(boost::asio::ssl::stream<boost::asio::ip::tcp::socket> const&, boost::asio::io_service&)
+		{
+			return false;
+		}
+
+		// һ, ͬһϵһ
+		void wait_next_request()
+		{
+			request_.raw_request().size = 0;
+			if (!memory_report::idle_release() || has_buffered_input(socket_))
+			{
+				do_read();
+				return;
+			}
+			park();
+		}
+
+		// ڴģʽ: ͷͻظĻ, null_bufferssocketɶ, ռ.
+		// TLSļ¼SSL_MODE_RELEASE_BUFFERSڶдͷ
+		void park()
+		{
+			reply_.release_memory();
+			request_.release_buffer();
+			std::string().swap(chunked_buf_);
+			parked_ = true;
+			memory_report::connection_parked(true);
+
+			reset_timer();
+			auto self = this->shared_from_this();
+			tcp_layer(socket_).async_read_some(boost::asio::null_buffers(),
+				[self, this](boost::system::error_code const& ec, std::size_t)
+			{
+				parked_ = false;
+				memory_report::connection_parked(false);
+				if (ec)
+				{
+					return;
+				}
+				do_read();
+			});
+		}
+
+		static boost::asio::ip::tcp::socket& tcp_layer(boost::asio::ip::tcp::socket& s)
+		{
+			return s;
+		}
+		static boost::asio::ip::tcp::socket& tcp_layer(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& s)
+		{
+			return s.next_layer();
+		}
+
+		// Ѿsocketûǵ, ʱsocketٱΪɶ
+		static bool has_buffered_input(boost::asio::ip::tcp::socket&)
+		{
+			return false;
+		}
+		static bool has_buffered_input(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& s)
+		{
+			auto ssl = s.native_handle();
+			return SSL_has_pending(ssl) || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+		}
+
+		std::size_t tls_memory(boost::asio::ip::tcp::socket const&) const
+		{
+			return 0;
+		}
+		std::size_t tls_memory(boost::asio::ssl::stream<boost::asio::ip::tcp::socket> const& s) const
+		{
+			auto ssl = const_cast<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>&>(s).native_handle();
+			bool released = parked_ && (SSL_get_mode(ssl) & SSL_MODE_RELEASE_BUFFERS) != 0;
+			return memory_report::tls_stream_buffers + (released ? 0 : memory_report::tls_record_buffers);
+		}
+
 		void do_read()
 		{
 			reset_timer();
@@ -146,6 +383,26 @@ namespace timax
 					boost::asio::placeholders::bytes_transferred));
 		}
 
+		void do_read_http2()
+		{
+			reset_timer();
+			auto self = this->shared_from_this();
+			socket_.async_read_some(boost::asio::buffer(http2_buf_),
+				[self, this](boost::system::error_code const& ec, std::size_t length)
+			{
+				if (ec)
+				{
+					return;
+				}
+
+				// ʱsessionGOAWAYر
+				if (http2_->consume(http2_buf_.data(), length))
+				{
+					do_read_http2();
+				}
+			});
+		}
+
 		void do_read_body()
 		{
 			reset_timer();
@@ -186,11 +443,24 @@ namespace timax
 
 		void do_write()
 		{
+			// ļһ黹û, ٻ
+			auto self = this->shared_from_this();
+			if (!reply_.prepare_file_body(*io_service_, self, [self, this] { do_write(); }))
+			{
+				return;
+			}
+
 			reset_timer();
 
 			check_keep_alive();
 
-			assert(reply_.headers_num("Content-Length", 14) == 1);
+			if (!reply_.header_buffer_wroted())
+			{
+				reply_.negotiate_encoding(request_);
+			}
+
+			// 304chunkedĻظûContent-Length
+			assert(reply_.headers_num("Content-Length", 14) <= 1);
 
 			std::vector<boost::asio::const_buffer> buffers;
 			write_finished_ = reply_.to_buffers(buffers);
@@ -201,8 +471,14 @@ namespace timax
 			}
 
 			boost::asio::async_write(socket_, buffers,
-				boost::bind(&connection::handle_write, this->shared_from_this(),
+				boost::bind(&connection::handle_write, self,
 					boost::asio::placeholders::error));
+
+			if (!write_finished_)
+			{
+				// дͬʱԤһ
+				reply_.prepare_file_body(*io_service_, self, {});
+			}
 		}
 
 		void do_request()
@@ -248,7 +524,18 @@ namespace timax
 
 			if (ret == -1)
 			{
-				//TODO: жǷhttp2
+				if (http2::is_preface(buf.buffer, buf.size))
+				{
+					start_http2(buf.buffer, buf.size);
+					return;
+				}
+				// picohttpparser"HTTP/2"ͷ-1, prefaceܻû
+				if (http2::is_preface_prefix(buf.buffer, buf.size))
+				{
+					do_read();
+					return;
+				}
+
 				reply_ = reply::stock_reply(reply::bad_request);
 				do_write();
 				return;
@@ -292,8 +579,7 @@ namespace timax
 					return;
 				}
 
-				request_.raw_request().size = 0;
-				do_read();
+				wait_next_request();
 				return;
 			}
 			do_write();
@@ -353,59 +639,83 @@ namespace timax
 	private:
 		void delay_write(const void* data, std::size_t size, reply::handler_ec_size_t handler)
 		{
-			reset_timer();
-			if (!reply_.header_buffer_wroted())
+			delay_write(std::vector<boost::asio::const_buffer>{ boost::asio::buffer(data, size) }, std::move(handler));
+		}
+
+		// ͷݺϲһд; һдǰύдŶ, ɺϲһд
+		void delay_write(std::vector<boost::asio::const_buffer> const& buffers, reply::handler_ec_size_t handler)
+		{
+			// ڱ̵߳(main.cppе/delay), ֻio_service߳޸
+			auto self = this->shared_from_this();
+			auto ios = io_service_.load();
+			ios->dispatch([self, this, ios, buffers, handler]() mutable
 			{
-				check_keep_alive();
-				assert(reply_.body_type() == reply::none);
-				std::vector<boost::asio::const_buffer> buffers;
-				auto finished = reply_.to_buffers(buffers);
-				assert(finished);
-				auto self = this->shared_from_this();
-				boost::asio::async_write(socket_, buffers,
-					[self, this, data, size, handler](const boost::system::error_code& ec, std::size_t /*length*/)
+				// Ͷ֮ǨƵ˱io_service, תȥ
+				if (io_service_ != ios)
 				{
-					if (ec)
-					{
-						handler(ec, 0);
-						return;
-					}
-
-					delay_write(data, size, std::move(handler));
-				});
-				return;
-			}
-
-			boost::asio::async_write(socket_, boost::asio::buffer(data, size), handler);
+					delay_write(buffers, std::move(handler));
+					return;
+				}
+				queue_delay_write(buffers, std::move(handler));
+			});
 		}
 
-		void delay_write(std::vector<boost::asio::const_buffer> const& buffers, reply::handler_ec_size_t handler)
+		void queue_delay_write(std::vector<boost::asio::const_buffer> const& buffers, reply::handler_ec_size_t handler)
 		{
 			reset_timer();
-			// TODO:ϲ
+			delay_write_t write;
 			if (!reply_.header_buffer_wroted())
 			{
+				// 101֮ӹЭ, websocketĳʱtiming_wheel, ÿsocketһʱ
+				if (reply_.status() == reply::switching_protocols)
+				{
+					boost::system::error_code ec;
+					deadline_.cancel(ec);
+					upgraded_ = true;
+				}
 				check_keep_alive();
 				assert(reply_.body_type() == reply::none);
-				std::vector<boost::asio::const_buffer> buffers;
-				auto finished = reply_.to_buffers(buffers);
+				auto finished = reply_.to_buffers(write.buffers);
 				assert(finished);
-				auto self = this->shared_from_this();
-				boost::asio::async_write(socket_, buffers,
-					[self, this, buffers, handler](const boost::system::error_code& ec, std::size_t /*length*/)
-				{
-					if (ec)
-					{
-						handler(ec, 0);
-						return;
-					}
+			}
+			write.buffers.insert(write.buffers.end(), buffers.begin(), buffers.end());
+			write.size = boost::asio::buffer_size(buffers);
+			write.handler = std::move(handler);
+			delay_writes_.push_back(std::move(write));
 
-					delay_write(buffers, std::move(handler));
-				});
-				return;
+			if (!delay_writing_)
+			{
+				flush_delay_writes();
+			}
+		}
+
+		void flush_delay_writes()
+		{
+			auto writes = boost::make_shared<std::vector<delay_write_t>>();
+			writes->swap(delay_writes_);
+			std::vector<boost::asio::const_buffer> buffers;
+			for (auto const& w : *writes)
+			{
+				buffers.insert(buffers.end(), w.buffers.begin(), w.buffers.end());
 			}
 
-			boost::asio::async_write(socket_, buffers, handler);
+			delay_writing_ = true;
+			auto self = this->shared_from_this();
+			boost::asio::async_write(socket_, buffers,
+				[self, this, writes](const boost::system::error_code& ec, std::size_t /*length*/)
+			{
+				// صύдŶ, ȫصһ𷢳
+				for (auto& w : *writes)
+				{
+					w.handler(ec, ec ? 0 : w.size);
+				}
+
+				delay_writing_ = false;
+				if (!delay_writes_.empty())
+				{
+					flush_delay_writes();
+				}
+			});
 		}
 
 		void delay_read(void* data, std::size_t size, reply::handler_ec_size_t handler)
@@ -452,6 +762,8 @@ namespace timax
 
 
 	private:
+		// migrateio߳޸, delay_writeڱ߳ж
+		std::atomic<boost::asio::io_service*> io_service_;
 		socket_type socket_;
 
 		request_handler_t& request_handler_;
@@ -466,6 +778,25 @@ namespace timax
 
 		bool keep_alive_ = false;
 
+		struct delay_write_t
+		{
+			std::vector<boost::asio::const_buffer> buffers;
+			std::size_t size;
+			reply::handler_ec_size_t handler;
+		};
+		std::vector<delay_write_t> delay_writes_;
+		bool delay_writing_ = false;
+
 		boost::asio::deadline_timer deadline_;
+		// Ѿظ101, deadline_ʹ
+		bool upgraded_ = false;
+
+		boost::shared_ptr<http2::session> http2_;
+		std::vector<char> http2_buf_;
+
+		// ڴģʽµȴһ, ûж
+		bool parked_ = false;
+
+		static const bool is_tls = !std::is_same<socket_type, boost::asio::ip::tcp::socket>::value;
 	};
 }
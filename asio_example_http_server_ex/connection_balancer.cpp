@@ -0,0 +1,124 @@
+#include "connection_balancer.hpp"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+namespace timax
+{
+	namespace
+	{
+		// 一次迁移太多会让两边的io线程都卡一下, 剩下的等下一轮
+		const std::size_t max_migrate_per_round = 256;
+	}
+
+	boost::asio::io_service::id connection_balancer::id;
+
+	connection_balancer::connection_balancer(boost::asio::io_service& ios)
+		: boost::asio::io_service::service(ios), size_(0)
+	{
+	}
+
+	connection_balancer::handle_t connection_balancer::add(migrate_func_t migrate)
+	{
+		auto entry = boost::make_shared<entry_t>();
+		entry->migrate = std::move(migrate);
+		entry->owner = this;
+		++size_;
+
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		// 顺便清掉已经释放的
+		if (entries_.size() >= 64 && entries_.size() >= 2 * size_)
+		{
+			std::size_t kept = 0;
+			for (auto& weak : entries_)
+			{
+				if (!weak.expired())
+				{
+					entries_[kept++] = std::move(weak);
+				}
+			}
+			entries_.resize(kept);
+		}
+		entries_.push_back(entry);
+		return entry;
+	}
+
+	std::size_t connection_balancer::migrate(std::size_t n, boost::asio::io_service& to)
+	{
+		// 迁移时会登记到to的balancer, 不能拿着锁
+		std::vector<handle_t> candidates;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			for (auto it = entries_.rbegin(); it != entries_.rend(); ++it)
+			{
+				if (auto entry = it->lock())
+				{
+					candidates.push_back(std::move(entry));
+				}
+			}
+		}
+
+		// 后登记的连接先迁, 它们的缓冲区通常还是热的
+		std::size_t moved = 0;
+		for (auto& entry : candidates)
+		{
+			if (moved == n)
+			{
+				break;
+			}
+			if (entry->migrate(to))
+			{
+				++moved;
+			}
+		}
+		return moved;
+	}
+
+	void connection_balancer::rebalance(std::vector<boost::asio::io_service*> const& services)
+	{
+		if (services.size() < 2)
+		{
+			return;
+		}
+
+		auto most = services[0];
+		auto least = services[0];
+		auto most_size = get(*most).size();
+		auto least_size = most_size;
+		for (auto ios : services)
+		{
+			auto size = get(*ios).size();
+			if (size > most_size)
+			{
+				most = ios;
+				most_size = size;
+			}
+			if (size < least_size)
+			{
+				least = ios;
+				least_size = size;
+			}
+		}
+
+		if (most_size - least_size < 2)
+		{
+			return;
+		}
+
+		auto n = (most_size - least_size) / 2;
+		if (n > max_migrate_per_round)
+		{
+			n = max_migrate_per_round;
+		}
+		most->post([most, least, n]
+		{
+			get(*most).migrate(n, *least);
+		});
+	}
+
+	void connection_balancer::shutdown_service()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		entries_.clear();
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <vector>
+
+namespace timax
+{
+	// 每个io_service一个, 登记可以迁移到别的io_service的长连接(websocket).
+	// 短的http请求靠轮询分配就够了, 不登记. 所有函数都可以在任何线程调用
+	class connection_balancer
+		: public boost::asio::io_service::service
+	{
+	public:
+		static boost::asio::io_service::id id;
+
+		// 在连接所在的io线程中调用, 返回false表示现在不能迁移(有未完成的读写等)
+		using migrate_func_t = boost::function<bool(boost::asio::io_service& to)>;
+
+		struct entry_t
+		{
+			migrate_func_t migrate;
+			connection_balancer* owner;
+
+			~entry_t()
+			{
+				--owner->size_;
+			}
+		};
+		// 连接持有handle, 释放时自动注销
+		using handle_t = boost::shared_ptr<entry_t>;
+
+		explicit connection_balancer(boost::asio::io_service& ios);
+
+		static connection_balancer& get(boost::asio::io_service& ios)
+		{
+			return boost::asio::use_service<connection_balancer>(ios);
+		}
+
+		handle_t add(migrate_func_t migrate);
+
+		std::size_t size() const
+		{
+			return size_;
+		}
+
+		// 把最多n个连接迁移到to, 返回迁走的个数. 只在这个io_service的线程中调用
+		std::size_t migrate(std::size_t n, boost::asio::io_service& to);
+
+		// 从登记连接最多的io_service往最少的迁移一批, 相差不到2个时不动
+		static void rebalance(std::vector<boost::asio::io_service*> const& services);
+
+	private:
+		void shutdown_service() override;
+
+		boost::mutex mutex_;
+		std::vector<boost::weak_ptr<entry_t>> entries_;
+		std::atomic<std::size_t> size_;
+	};
+}
@@ -0,0 +1,62 @@
+#include "cpu_features.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace timax
+{
+	namespace cpu
+	{
+		namespace
+		{
+			struct features_t
+			{
+				bool sse41 = false;
+				bool avx2 = false;
+			};
+
+			features_t detect()
+			{
+				features_t f;
+#if defined(TIMAX_X86_SIMD) && defined(_MSC_VER)
+				int regs[4];
+				__cpuid(regs, 0);
+				int max_leaf = regs[0];
+
+				__cpuid(regs, 1);
+				f.sse41 = (regs[2] & (1 << 19)) != 0;
+
+				// avx2还要确认操作系统保存ymm寄存器
+				bool osxsave = (regs[2] & (1 << 27)) != 0;
+				if (max_leaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
+				{
+					__cpuidex(regs, 7, 0);
+					f.avx2 = (regs[1] & (1 << 5)) != 0;
+				}
+#elif defined(TIMAX_X86_SIMD)
+				__builtin_cpu_init();
+				f.sse41 = __builtin_cpu_supports("sse4.1") != 0;
+				f.avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+				return f;
+			}
+
+			features_t const& features()
+			{
+				static const features_t f = detect();
+				return f;
+			}
+		}
+
+		bool has_sse41()
+		{
+			return features().sse41;
+		}
+
+		bool has_avx2()
+		{
+			return features().avx2;
+		}
+	}
+}
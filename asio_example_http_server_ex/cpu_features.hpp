@@ -0,0 +1,25 @@
+#pragma once
+
+// x86上SIMD实现的编译开关和运行时检测, 非x86时TIMAX_X86_SIMD不定义
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || (defined(__i386__) && defined(__SSE2__))
+#define TIMAX_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+// msvc不需要编译选项就能用这些intrinsics
+#define TIMAX_TARGET_SSE41
+#define TIMAX_TARGET_AVX2
+#else
+#define TIMAX_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TIMAX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace timax
+{
+	namespace cpu
+	{
+		// 结果在第一次调用时检测, 之后直接返回
+		bool has_sse41();
+		bool has_avx2();
+	}
+}
@@ -0,0 +1,41 @@
+#include "embedded_assets.hpp"
+#include "perfect_hash.hpp"
+
+namespace timax
+{
+	namespace embedded_assets
+	{
+#ifdef TIMAX_EMBEDDED_ASSETS
+		// defined in the file generated by tools/embed_assets
+		namespace generated
+		{
+			extern const embedded_asset table[];
+			extern const std::size_t table_size;
+			extern const uint32_t seeds[];
+			extern const std::size_t seeds_size;
+		}
+
+		embedded_asset const* find(boost::string_ref path)
+		{
+			using namespace generated;
+			if (table_size == 0)
+			{
+				return nullptr;
+			}
+
+			auto seed = seeds[perfect_hash::hash(path, 0) % seeds_size];
+			auto const& asset = table[perfect_hash::hash(path, seed) % table_size];
+			if (boost::string_ref(asset.path, asset.path_size) != path)
+			{
+				return nullptr;
+			}
+			return &asset;
+		}
+#else
+		embedded_asset const* find(boost::string_ref)
+		{
+			return nullptr;
+		}
+#endif
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace timax
+{
+	/// A file packed into the binary by tools/embed_assets, all headers are formatted at build time.
+	struct embedded_asset
+	{
+		/// "/index.html", relative to the packed directory
+		const char* path;
+		std::size_t path_size;
+		const char* content_type;
+
+		const unsigned char* data;
+		std::size_t size;
+		const char* content_length;
+		const char* etag;
+
+		/// gzip variant, null when it would not be smaller
+		const unsigned char* gzip_data;
+		std::size_t gzip_size;
+		const char* gzip_content_length;
+		const char* gzip_etag;
+	};
+
+	namespace embedded_assets
+	{
+		/// Return the asset packed for path, or null. Without an asset bundle in the build nothing is found.
+		embedded_asset const* find(boost::string_ref path);
+	}
+}
@@ -0,0 +1,421 @@
+#include "file_cache.hpp"
+#include "mime_types.hpp"
+#include "utils.h"
+
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <climits>
+#endif
+
+namespace timax
+{
+	file_handle::file_handle(int fd)
+		: fd_(fd)
+	{
+	}
+
+	file_handle::~file_handle()
+	{
+#ifdef _MSC_VER
+		_close(fd_);
+#else
+		::close(fd_);
+#endif
+	}
+
+	boost::shared_ptr<file_handle> file_handle::open(std::string const& path)
+	{
+#ifdef _MSC_VER
+		int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+		if (fd == -1)
+		{
+			return{};
+		}
+
+		return boost::make_shared<file_handle>(fd);
+	}
+
+	std::ptrdiff_t file_handle::read_at(uint64_t offset, void* data, std::size_t size) const
+	{
+#ifdef _MSC_VER
+		OVERLAPPED ov = {};
+		ov.Offset = static_cast<DWORD>(offset);
+		ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		DWORD length = 0;
+		if (!ReadFile(reinterpret_cast<HANDLE>(_get_osfhandle(fd_)), data, static_cast<DWORD>(size), &length, &ov))
+		{
+			return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+		}
+		return length;
+#else
+		for (;;)
+		{
+			auto ret = ::pread(fd_, data, size, static_cast<off_t>(offset));
+			if (ret == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			return ret;
+		}
+#endif
+	}
+
+	file_handle_ptr file_info::handle() const
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (!handle_)
+		{
+			handle_ = file_handle::open(path);
+		}
+		return handle_;
+	}
+
+	file_cache& file_cache::instance()
+	{
+		// never destroyed, the watcher thread may still be blocked on inotify at exit
+		static file_cache* cache = new file_cache;
+		return *cache;
+	}
+
+	file_cache::file_cache()
+	{
+#ifdef __linux__
+		inotify_fd_ = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd_ != -1)
+		{
+			boost::thread([this] { run_watcher(); }).detach();
+		}
+#endif
+	}
+
+	namespace
+	{
+		bool content_hash(std::string const& path, uint64_t size, std::string& etag)
+		{
+			auto handle = file_handle::open(path);
+			if (!handle)
+			{
+				return false;
+			}
+
+			std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+			if (!ctx || !EVP_DigestInit_ex(ctx.get(), EVP_sha1(), nullptr))
+			{
+				return false;
+			}
+			std::vector<char> buf(static_cast<std::size_t>(std::min<uint64_t>(size, 64 * 1024)) + 1);
+			for (uint64_t offset = 0;;)
+			{
+				auto len = handle->read_at(offset, buf.data(), buf.size());
+				if (len < 0)
+				{
+					return false;
+				}
+				if (len == 0)
+				{
+					break;
+				}
+				if (!EVP_DigestUpdate(ctx.get(), buf.data(), static_cast<std::size_t>(len)))
+				{
+					return false;
+				}
+				offset += len;
+			}
+
+			unsigned char digest[EVP_MAX_MD_SIZE];
+			unsigned int digest_length = 0;
+			if (!EVP_DigestFinal_ex(ctx.get(), digest, &digest_length))
+			{
+				return false;
+			}
+			char encoded[(EVP_MAX_MD_SIZE + 2) / 3 * 4 + 1];
+			auto len = base64_encode(encoded, digest, digest_length, 1);
+			etag = "\"";
+			etag.append(encoded, len);
+			etag += '"';
+			return true;
+		}
+	}
+
+	file_info_ptr file_cache::load(std::string const& path, etag_mode_t etag_mode)
+	{
+		boost::system::error_code ec;
+		if (!boost::filesystem::is_regular_file(path, ec))
+		{
+			return{};
+		}
+
+		auto size = boost::filesystem::file_size(path, ec);
+		if (ec)
+		{
+			return{};
+		}
+
+		auto last_time = boost::filesystem::last_write_time(path, ec);
+		if (ec)
+		{
+			return{};
+		}
+
+		auto info = boost::make_shared<file_info>();
+		info->path = path;
+		info->size = size;
+		info->last_write_time = last_time;
+		info->content_length = boost::lexical_cast<std::string>(size);
+		info->last_modified = http_date(last_time);
+
+		if (etag_mode == etag_content_hash)
+		{
+			if (!content_hash(path, size, info->etag))
+			{
+				return{};
+			}
+		}
+		else
+		{
+			// the same validator as nginx: "mtime-size" in hex
+			char hex[2 * sizeof(uint64_t) + 1];
+			info->etag = etag_mode == etag_weak_mtime_size ? "W/\"" : "\"";
+			integral_to_hex_str(static_cast<uint64_t>(last_time), hex);
+			info->etag += hex;
+			info->etag += '-';
+			integral_to_hex_str(static_cast<uint64_t>(size), hex);
+			info->etag += hex;
+			info->etag += '"';
+		}
+
+		info->content_type = mime_types::extension_to_type(boost::filesystem::path(path).extension().generic_string()).to_string();
+		return info;
+	}
+
+	file_info_ptr file_cache::lookup(boost::filesystem::path const& path)
+	{
+		auto key = path.generic_string();
+		etag_mode_t etag_mode;
+		if (inotify_fd_ == -1)
+		{
+			{
+				boost::lock_guard<boost::mutex> lock(mutex_);
+				etag_mode = etag_mode_;
+			}
+			return load(key, etag_mode);
+		}
+
+		uint64_t generation;
+		bool watched;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			etag_mode = etag_mode_;
+			auto it = entries_.find(key);
+			if (it != entries_.end())
+			{
+				return it->second;
+			}
+			if (misses_.count(key) != 0)
+			{
+				return{};
+			}
+
+			// watch before stat, so a change right after the stat still reaches us
+			watched = watch_directory(path.parent_path().generic_string());
+			generation = generation_;
+		}
+
+		auto info = load(key, etag_mode);
+
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (generation != generation_)
+		{
+			return info;
+		}
+
+		if (info)
+		{
+			if (entries_.size() >= max_entries_)
+			{
+				entries_.erase(entries_.begin());
+			}
+			entries_[key] = info;
+		}
+		else if (watched)
+		{
+			// misses are cached too, probing for precompressed variants would stat on every request otherwise.
+			// Without a watch on the directory nothing would ever drop the miss
+			if (misses_.size() >= max_misses_)
+			{
+				misses_.erase(misses_.begin());
+			}
+			misses_.insert(key);
+		}
+		return info;
+	}
+
+	void file_cache::invalidate(std::string const& path)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		invalidate_locked(path);
+	}
+
+	void file_cache::clear()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		++generation_;
+		entries_.clear();
+		misses_.clear();
+	}
+
+	void file_cache::set_etag_mode(etag_mode_t mode)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		etag_mode_ = mode;
+		++generation_;
+		entries_.clear();
+		misses_.clear();
+	}
+
+	void file_cache::set_max_entries(std::size_t max_entries)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		max_entries_ = max_entries;
+		while (entries_.size() > max_entries_)
+		{
+			entries_.erase(entries_.begin());
+		}
+	}
+
+	void file_cache::invalidate_locked(std::string const& path)
+	{
+		++generation_;
+		entries_.erase(path);
+		misses_.erase(path);
+
+		// path may be a directory which was moved or removed
+		auto prefix = path + '/';
+		for (auto it = entries_.begin(); it != entries_.end();)
+		{
+			if (it->first.compare(0, prefix.size(), prefix) == 0)
+			{
+				it = entries_.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		for (auto it = misses_.begin(); it != misses_.end();)
+		{
+			if (it->compare(0, prefix.size(), prefix) == 0)
+			{
+				it = misses_.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	bool file_cache::watch_directory(std::string const& dir)
+	{
+#ifdef __linux__
+		if (!watched_dirs_.insert(dir).second)
+		{
+			return true;
+		}
+
+		int wd = inotify_add_watch(inotify_fd_, dir.empty() ? "." : dir.c_str(),
+			IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_DELETE_SELF | IN_MOVE_SELF);
+		if (wd == -1)
+		{
+			watched_dirs_.erase(dir);
+			return false;
+		}
+		watch_descriptors_[wd] = dir;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void file_cache::run_watcher()
+	{
+#ifdef __linux__
+		alignas(inotify_event) char buf[64 * (sizeof(inotify_event) + NAME_MAX + 1)];
+		for (;;)
+		{
+			auto len = ::read(inotify_fd_, buf, sizeof(buf));
+			if (len <= 0)
+			{
+				if (len == -1 && errno == EINTR)
+				{
+					continue;
+				}
+				return;
+			}
+
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			for (char* p = buf; p < buf + len;)
+			{
+				auto ev = reinterpret_cast<inotify_event*>(p);
+				p += sizeof(inotify_event) + ev->len;
+
+				if (ev->mask & IN_Q_OVERFLOW)
+				{
+					++generation_;
+					entries_.clear();
+					misses_.clear();
+					continue;
+				}
+
+				auto it = watch_descriptors_.find(ev->wd);
+				if (it == watch_descriptors_.end())
+				{
+					continue;
+				}
+
+				if (ev->mask & IN_IGNORED)
+				{
+					// the directory is gone, it is watched again on the next lookup
+					invalidate_locked(it->second);
+					watched_dirs_.erase(it->second);
+					watch_descriptors_.erase(it);
+					continue;
+				}
+
+				if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+				{
+					invalidate_locked(it->second);
+					continue;
+				}
+
+				if (ev->len != 0)
+				{
+					auto const& dir = it->second;
+					invalidate_locked(dir.empty() ? std::string(ev->name) : dir + '/' + ev->name);
+				}
+			}
+		}
+#endif
+	}
+}
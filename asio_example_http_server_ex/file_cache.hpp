@@ -0,0 +1,120 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace timax
+{
+	/// A read-only file descriptor which can be read by several threads at once.
+	class file_handle
+		: private boost::noncopyable
+	{
+	public:
+		explicit file_handle(int fd);
+		~file_handle();
+
+		/// Open path for reading, return an empty pointer on failure.
+		static boost::shared_ptr<file_handle> open(std::string const& path);
+
+		/// Read at most size bytes at offset, the shared file position is not used.
+		/// Return the number of bytes read, 0 at end of file and -1 on error.
+		std::ptrdiff_t read_at(uint64_t offset, void* data, std::size_t size) const;
+
+	private:
+		int fd_;
+	};
+
+	using file_handle_ptr = boost::shared_ptr<file_handle>;
+
+	/// Metadata of a static file, everything a response needs is formatted once.
+	class file_info
+		: private boost::noncopyable
+	{
+	public:
+		std::string path;
+		uint64_t size = 0;
+		time_t last_write_time = 0;
+
+		std::string content_length;
+		std::string last_modified;
+		std::string etag;
+		std::string content_type;
+
+		/// The descriptor is opened on first use and kept until the entry is dropped.
+		file_handle_ptr handle() const;
+
+	private:
+		mutable boost::mutex mutex_;
+		mutable file_handle_ptr handle_;
+	};
+
+	using file_info_ptr = boost::shared_ptr<file_info const>;
+
+	/// A process wide cache of file metadata and open descriptors keyed by path.
+	/// Entries are dropped when inotify reports a change in their directory, on
+	/// platforms without inotify every lookup goes to the filesystem.
+	class file_cache
+		: private boost::noncopyable
+	{
+	public:
+		static file_cache& instance();
+
+		enum etag_mode_t
+		{
+			/// "mtime-size", the default
+			etag_mtime_size,
+			/// W/"mtime-size", for trees where a file may change twice within a second
+			etag_weak_mtime_size,
+			/// SHA-1 of the content, costs a full read of the file on every miss
+			etag_content_hash
+		};
+
+		/// Set before serving, the cache is cleared so every entry gets the new kind of ETag.
+		void set_etag_mode(etag_mode_t mode);
+
+		/// Return the cached metadata of path, or an empty pointer if path is not a regular file.
+		/// Both results are cached until inotify reports a change of path, a miss only
+		/// when its directory could be watched.
+		file_info_ptr lookup(boost::filesystem::path const& path);
+
+		void invalidate(std::string const& path);
+		void clear();
+
+		void set_max_entries(std::size_t max_entries);
+
+	private:
+		file_cache();
+
+		/// etag_mode is read by the caller under mutex_.
+		static file_info_ptr load(std::string const& path, etag_mode_t etag_mode);
+
+		/// Return false if dir can not be watched (e.g. it does not exist yet).
+		bool watch_directory(std::string const& dir);
+		void run_watcher();
+		void invalidate_locked(std::string const& path);
+
+		boost::mutex mutex_;
+		std::unordered_map<std::string, file_info_ptr> entries_;
+		std::size_t max_entries_ = 1024;
+		/// Paths known not to be regular files, kept apart so 404 probes never evict real entries.
+		std::unordered_set<std::string> misses_;
+		std::size_t max_misses_ = 256;
+		etag_mode_t etag_mode_ = etag_mtime_size;
+
+		/// Bumped on every invalidation, a lookup which raced with one does not insert its result.
+		uint64_t generation_ = 0;
+
+		int inotify_fd_ = -1;
+		std::unordered_set<std::string> watched_dirs_;
+		std::unordered_map<int, std::string> watch_descriptors_;
+	};
+}
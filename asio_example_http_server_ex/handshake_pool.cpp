@@ -0,0 +1,76 @@
+#include "handshake_pool.hpp"
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace timax
+{
+	handshake_pool& handshake_pool::instance()
+	{
+		// never destroyed, the threads run until the process exits
+		static handshake_pool* pool = new handshake_pool;
+		return *pool;
+	}
+
+	void handshake_pool::configure(std::size_t threads, std::size_t max_in_flight)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (!started_)
+		{
+			threads_ = threads;
+			max_in_flight_ = max_in_flight;
+		}
+	}
+
+	boost::asio::io_service& handshake_pool::get_io_service()
+	{
+		start();
+		// called from the accepting threads of all listeners
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		return pool_->get_io_service();
+	}
+
+	bool handshake_pool::acquire(boost::function<void()> resume)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (max_in_flight_ != 0 && in_flight_ >= max_in_flight_)
+		{
+			waiting_.push_back(std::move(resume));
+			return false;
+		}
+		++in_flight_;
+		return true;
+	}
+
+	void handshake_pool::release()
+	{
+		boost::function<void()> resume;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			--in_flight_;
+			if (waiting_.empty())
+			{
+				return;
+			}
+			resume = std::move(waiting_.front());
+			waiting_.pop_front();
+		}
+
+		// the resumed listener calls acquire again and may find the slot taken by another one
+		resume();
+	}
+
+	void handshake_pool::start()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (started_)
+		{
+			return;
+		}
+
+		started_ = true;
+		pool_.reset(new io_service_pool(threads_));
+		auto pool = pool_;
+		boost::thread([pool] { pool->run(); }).detach();
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "io_service_pool.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+
+namespace timax
+{
+	/// Threads for TLS handshakes, so the RSA/ECDHE work of a burst of new clients does not
+	/// hold up established connections on the server's threads. The socket is moved onto one
+	/// of the pool's io_services for the handshake and back to its own io_service afterwards.
+	/// Each io_service has one thread, so a handshake and its timeout never run concurrently.
+	class handshake_pool
+		: private boost::noncopyable
+	{
+	public:
+		static handshake_pool& instance();
+
+		/// Set before listening, the threads are started on first use. With 0 threads handshakes
+		/// run on the connection's io_service. At most max_in_flight connections are accepted
+		/// but not yet through their handshake, 0 means no limit.
+		void configure(std::size_t threads, std::size_t max_in_flight);
+
+		bool enabled() const
+		{
+			return threads_ != 0;
+		}
+
+		/// Round robin over the pool's io_services.
+		boost::asio::io_service& get_io_service();
+
+		/// Take a slot before accepting. When all are taken, false is returned and resume is
+		/// called from release() once a slot frees up, on the thread that released it.
+		bool acquire(boost::function<void()> resume);
+
+		/// Give the slot back after the handshake finished or the accept failed.
+		void release();
+
+	private:
+		handshake_pool() = default;
+
+		void start();
+
+		boost::shared_ptr<io_service_pool> pool_;
+
+		boost::mutex mutex_;
+		bool started_ = false;
+		std::size_t threads_ = 0;
+		std::size_t max_in_flight_ = 0;
+		std::size_t in_flight_ = 0;
+		/// Listeners paused because all slots were taken.
+		std::deque<boost::function<void()>> waiting_;
+	};
+}
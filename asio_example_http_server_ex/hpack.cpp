@@ -0,0 +1,525 @@
+#include "hpack.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace timax
+{
+	namespace http2
+	{
+		namespace
+		{
+			struct static_entry_t
+			{
+				const char* name;
+				const char* value;
+			};
+
+			const static_entry_t static_table[] =
+			{
+				{ ":authority", "" },
+				{ ":method", "GET" },
+				{ ":method", "POST" },
+				{ ":path", "/" },
+				{ ":path", "/index.html" },
+				{ ":scheme", "http" },
+				{ ":scheme", "https" },
+				{ ":status", "200" },
+				{ ":status", "204" },
+				{ ":status", "206" },
+				{ ":status", "304" },
+				{ ":status", "400" },
+				{ ":status", "404" },
+				{ ":status", "500" },
+				{ "accept-charset", "" },
+				{ "accept-encoding", "gzip, deflate" },
+				{ "accept-language", "" },
+				{ "accept-ranges", "" },
+				{ "accept", "" },
+				{ "access-control-allow-origin", "" },
+				{ "age", "" },
+				{ "allow", "" },
+				{ "authorization", "" },
+				{ "cache-control", "" },
+				{ "content-disposition", "" },
+				{ "content-encoding", "" },
+				{ "content-language", "" },
+				{ "content-length", "" },
+				{ "content-location", "" },
+				{ "content-range", "" },
+				{ "content-type", "" },
+				{ "cookie", "" },
+				{ "date", "" },
+				{ "etag", "" },
+				{ "expect", "" },
+				{ "expires", "" },
+				{ "from", "" },
+				{ "host", "" },
+				{ "if-match", "" },
+				{ "if-modified-since", "" },
+				{ "if-none-match", "" },
+				{ "if-range", "" },
+				{ "if-unmodified-since", "" },
+				{ "last-modified", "" },
+				{ "link", "" },
+				{ "location", "" },
+				{ "max-forwards", "" },
+				{ "proxy-authenticate", "" },
+				{ "proxy-authorization", "" },
+				{ "range", "" },
+				{ "referer", "" },
+				{ "refresh", "" },
+				{ "retry-after", "" },
+				{ "server", "" },
+				{ "set-cookie", "" },
+				{ "strict-transport-security", "" },
+				{ "transfer-encoding", "" },
+				{ "user-agent", "" },
+				{ "vary", "" },
+				{ "via", "" },
+				{ "www-authenticate", "" },
+			};
+			const std::size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+			// RFC 7541 Appendix B, index 256 is EOS
+			const uint32_t huffman_codes[] =
+			{
+				0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+				0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+				0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+				0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+				0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+				0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+				0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+				0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+				0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+				0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+				0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+				0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+				0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+				0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+				0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+				0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+				0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+				0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+				0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+				0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+				0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+				0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+				0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+				0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+				0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+				0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+				0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+				0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+				0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+				0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+				0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+				0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+				0x3fffffff,
+			};
+
+			const unsigned char huffman_lengths[] =
+			{
+				13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+				28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+				6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+				5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+				13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+				7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+				15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+				6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+				20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+				24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+				22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+				21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+				26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+				19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+				20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+				26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+				30,
+			};
+
+			// binary tree over the codes, walked one bit at a time
+			class huffman_tree
+			{
+			public:
+				huffman_tree()
+				{
+					nodes_.push_back(node_t());
+					for (int sym = 0; sym < 257; ++sym)
+					{
+						std::size_t node = 0;
+						for (int bit = huffman_lengths[sym] - 1; bit >= 0; --bit)
+						{
+							auto b = (huffman_codes[sym] >> bit) & 1;
+							if (nodes_[node].child[b] == 0)
+							{
+								nodes_[node].child[b] = static_cast<int16_t>(nodes_.size());
+								nodes_.push_back(node_t());
+							}
+							node = nodes_[node].child[b];
+						}
+						nodes_[node].symbol = static_cast<int16_t>(sym);
+					}
+				}
+
+				bool decode(const unsigned char* data, std::size_t length, std::string& out) const
+				{
+					std::size_t node = 0;
+					// bits since the last symbol, they must be a prefix of EOS (all ones, under 8)
+					int depth = 0;
+					bool all_ones = true;
+					for (std::size_t i = 0; i < length; ++i)
+					{
+						for (int bit = 7; bit >= 0; --bit)
+						{
+							auto b = (data[i] >> bit) & 1;
+							node = nodes_[node].child[b];
+							++depth;
+							all_ones = all_ones && b == 1;
+							if (node == 0)
+							{
+								return false;
+							}
+
+							auto sym = nodes_[node].symbol;
+							if (sym >= 0)
+							{
+								if (sym == 256)
+								{
+									return false;
+								}
+								out.push_back(static_cast<char>(sym));
+								node = 0;
+								depth = 0;
+								all_ones = true;
+							}
+						}
+					}
+					return depth < 8 && all_ones;
+				}
+
+			private:
+				struct node_t
+				{
+					int16_t child[2] = { 0, 0 };
+					int16_t symbol = -1;
+				};
+				std::vector<node_t> nodes_;
+			};
+
+			bool decode_int(const unsigned char*& p, const unsigned char* end, int prefix_bits, std::size_t& value)
+			{
+				if (p == end)
+				{
+					return false;
+				}
+
+				std::size_t max_prefix = (1u << prefix_bits) - 1;
+				value = *p++ & max_prefix;
+				if (value < max_prefix)
+				{
+					return true;
+				}
+
+				for (int shift = 0; p != end && shift <= 28; shift += 7)
+				{
+					auto b = *p++;
+					value += static_cast<std::size_t>(b & 0x7f) << shift;
+					if ((b & 0x80) == 0)
+					{
+						return true;
+					}
+				}
+				return false;
+			}
+
+			bool decode_string(const unsigned char*& p, const unsigned char* end, std::string& out)
+			{
+				if (p == end)
+				{
+					return false;
+				}
+
+				bool huffman = (*p & 0x80) != 0;
+				std::size_t length;
+				if (!decode_int(p, end, 7, length) || length > static_cast<std::size_t>(end - p))
+				{
+					return false;
+				}
+
+				out.clear();
+				if (huffman)
+				{
+					static const huffman_tree tree;
+					if (!tree.decode(p, length, out))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					out.assign(reinterpret_cast<const char*>(p), length);
+				}
+				p += length;
+				return true;
+			}
+
+			void encode_int(std::size_t value, int prefix_bits, unsigned char first, std::string& out)
+			{
+				std::size_t max_prefix = (1u << prefix_bits) - 1;
+				if (value < max_prefix)
+				{
+					out.push_back(static_cast<char>(first | value));
+					return;
+				}
+
+				out.push_back(static_cast<char>(first | max_prefix));
+				value -= max_prefix;
+				while (value >= 128)
+				{
+					out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+					value >>= 7;
+				}
+				out.push_back(static_cast<char>(value));
+			}
+
+			void encode_string(boost::string_ref str, std::string& out)
+			{
+				std::size_t bits = 0;
+				for (auto c : str)
+				{
+					bits += huffman_lengths[static_cast<unsigned char>(c)];
+				}
+
+				auto huffman_length = (bits + 7) / 8;
+				if (huffman_length >= str.size())
+				{
+					encode_int(str.size(), 7, 0, out);
+					out.append(str.data(), str.size());
+					return;
+				}
+
+				encode_int(huffman_length, 7, 0x80, out);
+				uint64_t acc = 0;
+				int acc_bits = 0;
+				for (auto c : str)
+				{
+					auto sym = static_cast<unsigned char>(c);
+					acc = (acc << huffman_lengths[sym]) | huffman_codes[sym];
+					acc_bits += huffman_lengths[sym];
+					while (acc_bits >= 8)
+					{
+						acc_bits -= 8;
+						out.push_back(static_cast<char>(acc >> acc_bits));
+					}
+				}
+				if (acc_bits > 0)
+				{
+					// padded with the most significant bits of EOS
+					out.push_back(static_cast<char>((acc << (8 - acc_bits)) | (0xff >> acc_bits)));
+				}
+			}
+		}
+
+		hpack_decoder::hpack_decoder(std::size_t max_table_size)
+			: capacity_(max_table_size), max_capacity_(max_table_size)
+		{
+		}
+
+		bool hpack_decoder::decode(const unsigned char* data, std::size_t length, std::size_t max_list_size,
+			std::vector<header_field_t>& headers, bool& oversized)
+		{
+			auto p = data;
+			auto end = data + length;
+			bool first = true;
+			std::size_t list_size = 0;
+			oversized = false;
+			auto add = [&](std::size_t size)
+			{
+				list_size += size;
+				if (!oversized && list_size > max_list_size)
+				{
+					// a one byte reference can stand for a 4K entry, so never keep the expanded list
+					oversized = true;
+					std::vector<header_field_t>().swap(headers);
+				}
+				return !oversized;
+			};
+			while (p != end)
+			{
+				auto b = *p;
+				std::size_t index;
+				std::size_t size;
+				header_field_t field;
+				if (b & 0x80)
+				{
+					// indexed header field, once oversized only the index is checked and nothing is copied
+					if (!decode_int(p, end, 7, index) || !lookup_size(index, size))
+					{
+						return false;
+					}
+					if (add(size))
+					{
+						lookup(index, field);
+						headers.push_back(std::move(field));
+					}
+				}
+				else if ((b & 0xe0) == 0x20)
+				{
+					// dynamic table size update, only at the start of a block
+					if (!first || !decode_int(p, end, 5, index) || index > max_capacity_)
+					{
+						return false;
+					}
+					capacity_ = index;
+					evict(capacity_);
+					continue;
+				}
+				else
+				{
+					// literal, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+					bool indexing = (b & 0x40) != 0;
+					if (!decode_int(p, end, indexing ? 6 : 4, index))
+					{
+						return false;
+					}
+					if (index == 0)
+					{
+						if (!decode_string(p, end, field.name))
+						{
+							return false;
+						}
+					}
+					else if (!lookup(index, field))
+					{
+						return false;
+					}
+					if (!decode_string(p, end, field.value))
+					{
+						return false;
+					}
+					if (indexing)
+					{
+						insert(field);
+					}
+					if (add(field.name.size() + field.value.size() + 32))
+					{
+						headers.push_back(std::move(field));
+					}
+				}
+				first = false;
+			}
+			return true;
+		}
+
+		bool hpack_decoder::lookup(std::size_t index, header_field_t& field) const
+		{
+			if (index == 0)
+			{
+				return false;
+			}
+			if (index <= static_table_size)
+			{
+				field.name = static_table[index - 1].name;
+				field.value = static_table[index - 1].value;
+				return true;
+			}
+
+			index -= static_table_size + 1;
+			if (index >= table_.size())
+			{
+				return false;
+			}
+			field = table_[index];
+			return true;
+		}
+
+		bool hpack_decoder::lookup_size(std::size_t index, std::size_t& size) const
+		{
+			if (index == 0)
+			{
+				return false;
+			}
+			if (index <= static_table_size)
+			{
+				size = std::strlen(static_table[index - 1].name) + std::strlen(static_table[index - 1].value) + 32;
+				return true;
+			}
+
+			index -= static_table_size + 1;
+			if (index >= table_.size())
+			{
+				return false;
+			}
+			size = table_[index].name.size() + table_[index].value.size() + 32;
+			return true;
+		}
+
+		void hpack_decoder::insert(header_field_t const& field)
+		{
+			auto size = field.name.size() + field.value.size() + 32;
+			if (size > capacity_)
+			{
+				// an entry larger than the table empties it
+				evict(0);
+				return;
+			}
+
+			evict(capacity_ - size);
+			table_.push_front(field);
+			table_size_ += size;
+		}
+
+		void hpack_decoder::evict(std::size_t capacity)
+		{
+			while (table_size_ > capacity)
+			{
+				auto const& last = table_.back();
+				table_size_ -= last.name.size() + last.value.size() + 32;
+				table_.pop_back();
+			}
+		}
+
+		void hpack_encode(boost::string_ref name, boost::string_ref value, std::string& out)
+		{
+			std::size_t name_index = 0;
+			for (std::size_t i = 0; i < static_table_size; ++i)
+			{
+				if (name == static_table[i].name)
+				{
+					if (value == static_table[i].value)
+					{
+						encode_int(i + 1, 7, 0x80, out);
+						return;
+					}
+					if (name_index == 0)
+					{
+						name_index = i + 1;
+					}
+				}
+			}
+
+			// literal without indexing
+			encode_int(name_index, 4, 0, out);
+			if (name_index == 0)
+			{
+				encode_string(name, out);
+			}
+			encode_string(value, out);
+		}
+
+		void hpack_encode_status(int status, std::string& out)
+		{
+			char value[4] =
+			{
+				static_cast<char>('0' + status / 100 % 10),
+				static_cast<char>('0' + status / 10 % 10),
+				static_cast<char>('0' + status % 10),
+				0
+			};
+			hpack_encode(":status", boost::string_ref(value, 3), out);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace timax
+{
+	namespace http2
+	{
+		struct header_field_t
+		{
+			std::string name;
+			std::string value;
+		};
+
+		// HPACK (RFC 7541) decoder for the header blocks of one connection, the dynamic table
+		// carries over from block to block
+		class hpack_decoder
+		{
+		public:
+			// max_table_size is what we advertise in SETTINGS_HEADER_TABLE_SIZE
+			explicit hpack_decoder(std::size_t max_table_size = 4096);
+
+			// decode a complete header block, false is a compression error and ends the connection.
+			// Fields count name + value + 32 bytes like SETTINGS_MAX_HEADER_LIST_SIZE. Past max_list_size
+			// headers is emptied and oversized set, the rest of the block is only decoded to keep the
+			// dynamic table in sync
+			bool decode(const unsigned char* data, std::size_t length, std::size_t max_list_size,
+				std::vector<header_field_t>& headers, bool& oversized);
+
+		private:
+			bool lookup(std::size_t index, header_field_t& field) const;
+			bool lookup_size(std::size_t index, std::size_t& size) const;
+			void insert(header_field_t const& field);
+			void evict(std::size_t capacity);
+
+			// newest entry first
+			std::deque<header_field_t> table_;
+			std::size_t table_size_ = 0;
+			std::size_t capacity_;
+			std::size_t max_capacity_;
+		};
+
+		// append name/value to a header block. Nothing is inserted into the dynamic table, so the
+		// peer's SETTINGS_HEADER_TABLE_SIZE does not matter. name must be lower case
+		void hpack_encode(boost::string_ref name, boost::string_ref value, std::string& out);
+		void hpack_encode_status(int status, std::string& out);
+	}
+}
@@ -0,0 +1,1219 @@
+#include "http2.hpp"
+#include "utils.h"
+
+#include <boost/make_shared.hpp>
+
+#include <cstring>
+#include <ctime>
+
+namespace timax
+{
+	namespace http2
+	{
+		namespace
+		{
+			const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+			const std::size_t client_preface_length = sizeof(client_preface) - 1;
+			// 请求行"PRI * HTTP/2.0"之后的部分可能还没读到, 由session校验
+			const std::size_t preface_request_line = 16;
+
+			enum frame_type_t : uint8_t
+			{
+				DATA = 0,
+				HEADERS = 1,
+				PRIORITY = 2,
+				RST_STREAM = 3,
+				SETTINGS = 4,
+				PUSH_PROMISE = 5,
+				PING = 6,
+				GOAWAY = 7,
+				WINDOW_UPDATE = 8,
+				CONTINUATION = 9
+			};
+
+			enum frame_flag_t : uint8_t
+			{
+				FLAG_END_STREAM = 0x1,
+				FLAG_ACK = 0x1,
+				FLAG_END_HEADERS = 0x4,
+				FLAG_PADDED = 0x8,
+				FLAG_PRIORITY = 0x20
+			};
+
+			enum error_code_t : uint32_t
+			{
+				NO_ERROR = 0,
+				PROTOCOL_ERROR = 1,
+				INTERNAL_ERROR = 2,
+				FLOW_CONTROL_ERROR = 3,
+				STREAM_CLOSED = 5,
+				FRAME_SIZE_ERROR = 6,
+				REFUSED_STREAM = 7,
+				CANCEL = 8,
+				COMPRESSION_ERROR = 9,
+				ENHANCE_YOUR_CALM = 11
+			};
+
+			enum setting_t : uint16_t
+			{
+				SETTINGS_HEADER_TABLE_SIZE = 1,
+				SETTINGS_ENABLE_PUSH = 2,
+				SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+				SETTINGS_INITIAL_WINDOW_SIZE = 4,
+				SETTINGS_MAX_FRAME_SIZE = 5,
+				SETTINGS_MAX_HEADER_LIST_SIZE = 6
+			};
+
+			// 我们的设置
+			const uint32_t max_concurrent_streams = 128;
+			const std::size_t max_frame_size = 16384;
+			// 与HTTP/1.1相同, 请求头部和body合计不超过2M
+			const std::size_t max_request_size = 2 * 1024 * 1024;
+			const std::size_t stream_window = 1 << 20;
+			// 连接的窗口只在body释放后才还给对方, 所以也是一个连接缓冲的body的上限
+			const std::size_t connection_window = 4 * max_request_size;
+			const std::size_t max_header_block = 64 * 1024;
+			// 解码后的头部, 按SETTINGS_MAX_HEADER_LIST_SIZE计算, 128个stream合计也不过8M
+			const std::size_t max_header_list_size = 64 * 1024;
+			const int64_t max_window = 0x7fffffff;
+			// 一次写出的DATA
+			const std::size_t write_budget = 256 * 1024;
+
+			uint32_t read_u32(const unsigned char* p)
+			{
+				return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+			}
+
+			void append_u32(std::string& out, uint32_t value)
+			{
+				out.push_back(static_cast<char>(value >> 24));
+				out.push_back(static_cast<char>(value >> 16));
+				out.push_back(static_cast<char>(value >> 8));
+				out.push_back(static_cast<char>(value));
+			}
+
+			// 去掉PADDED帧的填充
+			bool strip_padding(uint8_t flags, const unsigned char*& payload, std::size_t& length)
+			{
+				if ((flags & FLAG_PADDED) == 0)
+				{
+					return true;
+				}
+				if (length < 1 || payload[0] >= length)
+				{
+					return false;
+				}
+				length -= 1 + payload[0];
+				payload += 1;
+				return true;
+			}
+
+			bool is_connection_header(boost::string_ref name)
+			{
+				return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+					|| name == "transfer-encoding" || name == "upgrade";
+			}
+
+			bool has_invalid_char(std::string const& s)
+			{
+				return s.find_first_of(std::string("\r\n\0", 3)) != std::string::npos;
+			}
+
+			int select_alpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*)
+			{
+				static const unsigned char protos[] = "\x02h2\x08http/1.1";
+				unsigned char* selected = nullptr;
+				if (SSL_select_next_proto(&selected, outlen, protos, sizeof(protos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+				{
+					return SSL_TLSEXT_ERR_NOACK;
+				}
+				*out = selected;
+				return SSL_TLSEXT_ERR_OK;
+			}
+		}
+
+		bool is_preface(const char* data, std::size_t length)
+		{
+			return length >= preface_request_line && std::memcmp(data, client_preface, preface_request_line) == 0;
+		}
+
+		bool is_preface_prefix(const char* data, std::size_t length)
+		{
+			return length < preface_request_line && std::memcmp(data, client_preface, length) == 0;
+		}
+
+		void enable_alpn(boost::asio::ssl::context& ctx)
+		{
+			SSL_CTX_set_alpn_select_cb(ctx.native_handle(), select_alpn, nullptr);
+		}
+
+		bool negotiated(SSL* ssl)
+		{
+			const unsigned char* proto = nullptr;
+			unsigned int length = 0;
+			SSL_get0_alpn_selected(ssl, &proto, &length);
+			return length == 2 && std::memcmp(proto, "h2", 2) == 0;
+		}
+
+		session::session(boost::asio::io_service& ios, request_handler_t& handler, write_func_t write, close_func_t close, boost::weak_ptr<void> owner)
+			: ios_(ios), handler_(handler), write_(std::move(write)), close_(std::move(close)), owner_(std::move(owner))
+		{
+		}
+
+		void session::start(const char* data, std::size_t length)
+		{
+			frame_header(4 * 6, SETTINGS, 0, 0);
+			out_.push_back(0);
+			out_.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+			append_u32(out_, max_concurrent_streams);
+			out_.push_back(0);
+			out_.push_back(SETTINGS_INITIAL_WINDOW_SIZE);
+			append_u32(out_, stream_window);
+			out_.push_back(0);
+			out_.push_back(SETTINGS_ENABLE_PUSH);
+			append_u32(out_, 0);
+			out_.push_back(0);
+			out_.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+			append_u32(out_, max_header_list_size);
+			window_update(0, connection_window - 65535);
+			conn_recv_window_ = connection_window;
+
+			if (!consume(data, length))
+			{
+				return;
+			}
+			flush();
+		}
+
+		bool session::consume(const char* data, std::size_t length)
+		{
+			if (closing_)
+			{
+				return false;
+			}
+
+			in_.append(data, length);
+			std::size_t pos = 0;
+			if (!preface_received_)
+			{
+				auto n = std::min(in_.size(), client_preface_length);
+				if (in_.compare(0, n, client_preface, n) != 0)
+				{
+					connection_error(PROTOCOL_ERROR);
+					flush();
+					return false;
+				}
+				if (n < client_preface_length)
+				{
+					return true;
+				}
+				preface_received_ = true;
+				pos = client_preface_length;
+			}
+
+			while (in_.size() - pos >= 9)
+			{
+				auto p = reinterpret_cast<const unsigned char*>(in_.data() + pos);
+				std::size_t frame_length = (std::size_t(p[0]) << 16) | (std::size_t(p[1]) << 8) | p[2];
+				if (frame_length > max_frame_size)
+				{
+					connection_error(FRAME_SIZE_ERROR);
+					break;
+				}
+				if (in_.size() - pos - 9 < frame_length)
+				{
+					break;
+				}
+
+				if (!handle_frame(p[3], p[4], read_u32(p + 5) & 0x7fffffff, p + 9, frame_length))
+				{
+					break;
+				}
+				pos += 9 + frame_length;
+			}
+
+			in_.erase(0, pos);
+			flush();
+			return !closing_;
+		}
+
+		bool session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length)
+		{
+			// 头部块必须连续
+			if (continuation_stream_ != 0 && (type != CONTINUATION || stream_id != continuation_stream_))
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+
+			switch (type)
+			{
+			case DATA:
+				return handle_data(flags, stream_id, payload, length);
+			case HEADERS:
+				return handle_headers(flags, stream_id, payload, length);
+			case CONTINUATION:
+				if (continuation_stream_ == 0)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				if (header_block_.size() + length > max_header_block)
+				{
+					return connection_error(ENHANCE_YOUR_CALM);
+				}
+				header_block_.append(reinterpret_cast<const char*>(payload), length);
+				if (flags & FLAG_END_HEADERS)
+				{
+					continuation_stream_ = 0;
+					return process_headers(stream_id, continuation_end_stream_);
+				}
+				return true;
+			case PRIORITY:
+				if (stream_id == 0)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				if (length != 5)
+				{
+					return connection_error(FRAME_SIZE_ERROR);
+				}
+				return true;
+			case RST_STREAM:
+			{
+				if (stream_id == 0 || stream_id > last_stream_id_)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				if (length != 4)
+				{
+					return connection_error(FRAME_SIZE_ERROR);
+				}
+				auto it = streams_.find(stream_id);
+				if (it != streams_.end())
+				{
+					it->second->local_closed = true;
+					it->second->remote_closed = true;
+					close_stream(*it->second);
+				}
+				return true;
+			}
+			case SETTINGS:
+				return handle_settings(flags, stream_id, payload, length);
+			case PUSH_PROMISE:
+				return connection_error(PROTOCOL_ERROR);
+			case PING:
+				if (stream_id != 0)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				if (length != 8)
+				{
+					return connection_error(FRAME_SIZE_ERROR);
+				}
+				if ((flags & FLAG_ACK) == 0)
+				{
+					frame_header(8, PING, FLAG_ACK, 0);
+					out_.append(reinterpret_cast<const char*>(payload), 8);
+				}
+				return true;
+			case GOAWAY:
+				if (stream_id != 0)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				// 客户端不会再开新的stream, 已有的照常完成
+				return true;
+			case WINDOW_UPDATE:
+				return handle_window_update(stream_id, payload, length);
+			default:
+				// 未知类型的帧忽略
+				return true;
+			}
+		}
+
+		bool session::handle_data(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length)
+		{
+			if (stream_id == 0)
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+
+			// 填充也计入流控
+			if (static_cast<int64_t>(length) > conn_recv_window_)
+			{
+				return connection_error(FLOW_CONTROL_ERROR);
+			}
+			conn_recv_window_ -= length;
+
+			auto flow_length = length;
+			if (!strip_padding(flags, payload, length))
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+
+			auto it = streams_.find(stream_id);
+			if (it == streams_.end() || it->second->remote_closed)
+			{
+				if (stream_id > last_stream_id_)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				// 已经关闭或被拒绝的stream, 数据丢弃
+				consumed(flow_length);
+				if (it != streams_.end())
+				{
+					reset_stream(*it->second, STREAM_CLOSED);
+				}
+				else
+				{
+					frame_header(4, RST_STREAM, 0, stream_id);
+					append_u32(out_, STREAM_CLOSED);
+				}
+				return true;
+			}
+
+			auto stream = it->second;
+			if (static_cast<int64_t>(flow_length) > stream->recv_window)
+			{
+				consumed(flow_length);
+				reset_stream(*stream, FLOW_CONTROL_ERROR);
+				return true;
+			}
+			stream->recv_window -= flow_length;
+			if (stream->body.size() + length > max_request_size)
+			{
+				consumed(flow_length);
+				reset_stream(*stream, ENHANCE_YOUR_CALM);
+				return true;
+			}
+			stream->body.append(reinterpret_cast<const char*>(payload), length);
+			stream->buffered += length;
+			// 填充不保存
+			consumed(flow_length - length);
+
+			if (flags & FLAG_END_STREAM)
+			{
+				stream->remote_closed = true;
+				dispatch(stream);
+				return true;
+			}
+
+			// body收齐才交给handler, 窗口只放到比max_request_size多一帧, 超过的在上面拒绝
+			if (stream->recv_window < static_cast<int64_t>(stream_window / 2))
+			{
+				auto target = static_cast<int64_t>(std::min(stream_window, max_request_size + max_frame_size - stream->body.size()));
+				if (target > stream->recv_window)
+				{
+					window_update(stream_id, static_cast<std::size_t>(target - stream->recv_window));
+					stream->recv_window = target;
+				}
+			}
+			return true;
+		}
+
+		bool session::handle_headers(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length)
+		{
+			if (stream_id == 0 || (stream_id & 1) == 0)
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+			if (!strip_padding(flags, payload, length))
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+			if (flags & FLAG_PRIORITY)
+			{
+				// 不按优先级调度, 只检查不依赖自己
+				if (length < 5)
+				{
+					return connection_error(FRAME_SIZE_ERROR);
+				}
+				if ((read_u32(payload) & 0x7fffffff) == stream_id)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				payload += 5;
+				length -= 5;
+			}
+
+			header_block_.assign(reinterpret_cast<const char*>(payload), length);
+			if ((flags & FLAG_END_HEADERS) == 0)
+			{
+				continuation_stream_ = stream_id;
+				continuation_end_stream_ = (flags & FLAG_END_STREAM) != 0;
+				return true;
+			}
+			return process_headers(stream_id, (flags & FLAG_END_STREAM) != 0);
+		}
+
+		bool session::process_headers(uint32_t stream_id, bool end_stream)
+		{
+			// 被拒绝的stream也要解码, 保持动态表同步
+			std::vector<header_field_t> headers;
+			bool oversized = false;
+			if (!decoder_.decode(reinterpret_cast<const unsigned char*>(header_block_.data()), header_block_.size(),
+				max_header_list_size, headers, oversized))
+			{
+				return connection_error(COMPRESSION_ERROR);
+			}
+			header_block_.clear();
+
+			auto it = streams_.find(stream_id);
+			if (it != streams_.end())
+			{
+				// trailer, 没有别的用处, 忽略内容
+				auto stream = it->second;
+				if (stream->remote_closed)
+				{
+					reset_stream(*stream, STREAM_CLOSED);
+					return true;
+				}
+				if (!end_stream)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				if (oversized)
+				{
+					reset_stream(*stream, ENHANCE_YOUR_CALM);
+					return true;
+				}
+				stream->remote_closed = true;
+				dispatch(stream);
+				return true;
+			}
+
+			if (stream_id <= last_stream_id_)
+			{
+				return connection_error(STREAM_CLOSED);
+			}
+			last_stream_id_ = stream_id;
+
+			auto stream = boost::make_shared<stream_t>();
+			stream->id = stream_id;
+			stream->send_window = peer_initial_window_;
+			stream->recv_window = stream_window;
+			stream->remote_closed = end_stream;
+			stream->headers = std::move(headers);
+			if (streams_.size() >= max_concurrent_streams)
+			{
+				reset_stream(*stream, REFUSED_STREAM);
+				return true;
+			}
+			if (oversized)
+			{
+				// 超过我们通告的SETTINGS_MAX_HEADER_LIST_SIZE, 与body过大一样重置
+				reset_stream(*stream, ENHANCE_YOUR_CALM);
+				return true;
+			}
+
+			streams_[stream_id] = stream;
+			if (end_stream)
+			{
+				dispatch(stream);
+			}
+			return true;
+		}
+
+		bool session::handle_settings(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length)
+		{
+			if (stream_id != 0)
+			{
+				return connection_error(PROTOCOL_ERROR);
+			}
+			if (flags & FLAG_ACK)
+			{
+				return length == 0 || connection_error(FRAME_SIZE_ERROR);
+			}
+			if (length % 6 != 0)
+			{
+				return connection_error(FRAME_SIZE_ERROR);
+			}
+
+			for (std::size_t i = 0; i < length; i += 6)
+			{
+				auto id = (uint16_t(payload[i]) << 8) | payload[i + 1];
+				auto value = read_u32(payload + i + 2);
+				switch (id)
+				{
+				case SETTINGS_ENABLE_PUSH:
+					if (value > 1)
+					{
+						return connection_error(PROTOCOL_ERROR);
+					}
+					break;
+				case SETTINGS_INITIAL_WINDOW_SIZE:
+				{
+					if (value > max_window)
+					{
+						return connection_error(FLOW_CONTROL_ERROR);
+					}
+					// 已有stream的窗口按差值调整, 可以变成负数
+					auto delta = int64_t(value) - peer_initial_window_;
+					peer_initial_window_ = value;
+					for (auto& s : streams_)
+					{
+						s.second->send_window += delta;
+						if (s.second->send_window > max_window)
+						{
+							return connection_error(FLOW_CONTROL_ERROR);
+						}
+					}
+				}
+					break;
+				case SETTINGS_MAX_FRAME_SIZE:
+					if (value < 16384 || value > 16777215)
+					{
+						return connection_error(PROTOCOL_ERROR);
+					}
+					peer_max_frame_size_ = value;
+					break;
+				default:
+					// 不往动态表里插入, 不推送, 其余设置与我们无关
+					break;
+				}
+			}
+
+			frame_header(0, SETTINGS, FLAG_ACK, 0);
+			return true;
+		}
+
+		bool session::handle_window_update(uint32_t stream_id, const unsigned char* payload, std::size_t length)
+		{
+			if (length != 4)
+			{
+				return connection_error(FRAME_SIZE_ERROR);
+			}
+
+			auto increment = read_u32(payload) & 0x7fffffff;
+			if (stream_id == 0)
+			{
+				if (increment == 0)
+				{
+					return connection_error(PROTOCOL_ERROR);
+				}
+				conn_send_window_ += increment;
+				if (conn_send_window_ > max_window)
+				{
+					return connection_error(FLOW_CONTROL_ERROR);
+				}
+				return true;
+			}
+
+			auto it = streams_.find(stream_id);
+			if (it == streams_.end())
+			{
+				return stream_id <= last_stream_id_ || connection_error(PROTOCOL_ERROR);
+			}
+			if (increment == 0)
+			{
+				reset_stream(*it->second, PROTOCOL_ERROR);
+				return true;
+			}
+			it->second->send_window += increment;
+			if (it->second->send_window > max_window)
+			{
+				reset_stream(*it->second, FLOW_CONTROL_ERROR);
+			}
+			return true;
+		}
+
+		void session::dispatch(stream_ptr const& stream)
+		{
+			if (!build_request(*stream))
+			{
+				reset_stream(*stream, PROTOCOL_ERROR);
+				return;
+			}
+
+			auto& req = stream->req;
+			auto& rep = stream->rep;
+			rep.set_get_connection_func(make_connection_func(stream));
+			if (req.parse_header(0) < 0)
+			{
+				// 头部太多等, 与HTTP/1.1一样回复400
+				rep = reply::stock_reply(reply::bad_request);
+			}
+			else
+			{
+				auto content_type = req.get_header("Content-Type", 12);
+				if (content_type.find("application/x-www-form-urlencoded") != boost::string_ref::npos)
+				{
+					req.parse_form_urlencoded();
+				}
+				else if (content_type.find("multipart/form-data") != boost::string_ref::npos)
+				{
+					req.parse_form_multipart();
+				}
+
+				if (handler_)
+				{
+					handler_(req, rep);
+				}
+				else
+				{
+					rep = reply::stock_reply(reply::not_found);
+				}
+			}
+
+			if (rep.is_delay())
+			{
+				stream->delayed = true;
+				return;
+			}
+			start_response(stream);
+		}
+
+		bool session::build_request(stream_t& stream)
+		{
+			// 转成HTTP/1.1的请求交给request解析, 后面的处理与HTTP/1.1完全相同
+			std::string method, path, authority, cookie;
+			bool has_scheme = false;
+			bool regular = false;
+			bool has_host = false;
+			bool has_content_length = false;
+			std::string header_text;
+			for (auto const& h : stream.headers)
+			{
+				if (h.name.empty() || has_invalid_char(h.name) || has_invalid_char(h.value))
+				{
+					return false;
+				}
+
+				if (h.name[0] == ':')
+				{
+					if (regular)
+					{
+						return false;
+					}
+					std::string* target = nullptr;
+					if (h.name == ":method")
+					{
+						target = &method;
+					}
+					else if (h.name == ":path")
+					{
+						target = &path;
+					}
+					else if (h.name == ":authority")
+					{
+						target = &authority;
+					}
+					else if (h.name == ":scheme")
+					{
+						has_scheme = true;
+						continue;
+					}
+					else
+					{
+						return false;
+					}
+					if (!target->empty())
+					{
+						return false;
+					}
+					*target = h.value;
+					continue;
+				}
+
+				regular = true;
+				for (auto c : h.name)
+				{
+					if (c >= 'A' && c <= 'Z')
+					{
+						return false;
+					}
+				}
+				if (is_connection_header(h.name) || (h.name == "te" && h.value != "trailers"))
+				{
+					return false;
+				}
+
+				if (h.name == "cookie")
+				{
+					// 拆开的cookie合成一个头部
+					if (!cookie.empty())
+					{
+						cookie += "; ";
+					}
+					cookie += h.value;
+					continue;
+				}
+				has_host = has_host || h.name == "host";
+				has_content_length = has_content_length || h.name == "content-length";
+				header_text += h.name;
+				header_text += ": ";
+				header_text += h.value;
+				header_text += "\r\n";
+			}
+
+			if (method.empty() || (method != "CONNECT" && (path.empty() || !has_scheme)))
+			{
+				return false;
+			}
+			stream.head = method == "HEAD";
+
+			std::string text = method + " " + (path.empty() ? authority : path) + " HTTP/1.1\r\n";
+			if (!has_host && !authority.empty())
+			{
+				text += "host: " + authority + "\r\n";
+			}
+			if (!cookie.empty())
+			{
+				text += "cookie: " + cookie + "\r\n";
+			}
+			text += header_text;
+			if (!has_content_length && !stream.body.empty())
+			{
+				text += "content-length: " + std::to_string(stream.body.size()) + "\r\n";
+			}
+			text += "\r\n";
+
+			auto& req = stream.req;
+			auto& buf = req.raw_request();
+			// 先解析一次空缓冲区, increase_buffer要修正其中的指针
+			buf.size = 0;
+			req.parse_header(0);
+			auto total = text.size() + stream.body.size();
+			if (buf.max_size < total)
+			{
+				req.increase_buffer(total - buf.max_size);
+			}
+			std::memcpy(buf.buffer, text.data(), text.size());
+			std::memcpy(buf.buffer + text.size(), stream.body.data(), stream.body.size());
+			buf.size = total;
+			std::string().swap(stream.body);
+			return true;
+		}
+
+		void session::start_response(stream_ptr const& stream)
+		{
+			if (stream->local_closed)
+			{
+				return;
+			}
+
+			auto& rep = stream->rep;
+			rep.negotiate_encoding(stream->req);
+			rep.set_chunked_framing(false);
+
+			bool no_body = stream->head || rep.body_type() == reply::none;
+			send_headers(*stream, no_body);
+			if (no_body)
+			{
+				stream->body_finished = true;
+				close_stream(*stream);
+			}
+		}
+
+		void session::send_headers(stream_t& stream, bool end_stream)
+		{
+			auto& rep = stream.rep;
+			std::string block;
+			hpack_encode_status(rep.status(), block);
+			bool has_date = false;
+			std::string name;
+			for (auto const& h : rep.headers())
+			{
+				name = h.name;
+				for (auto& c : name)
+				{
+					if (c >= 'A' && c <= 'Z')
+					{
+						c = static_cast<char>(c - 'A' + 'a');
+					}
+				}
+				if (is_connection_header(name))
+				{
+					continue;
+				}
+				has_date = has_date || name == "date";
+				hpack_encode(name, h.value, block);
+			}
+			if (!has_date)
+			{
+				hpack_encode("date", http_date(time(nullptr)), block);
+			}
+
+			// 超过对方的帧大小时拆成CONTINUATION
+			uint8_t type = HEADERS;
+			uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+			std::size_t offset = 0;
+			do
+			{
+				auto n = std::min(block.size() - offset, peer_max_frame_size_);
+				bool last = offset + n == block.size();
+				frame_header(n, type, flags | (last ? FLAG_END_HEADERS : 0), stream.id);
+				out_.append(block, offset, n);
+				offset += n;
+				type = CONTINUATION;
+				flags = 0;
+			} while (offset < block.size());
+
+			stream.headers_sent = true;
+			if (end_stream)
+			{
+				stream.local_closed = true;
+			}
+		}
+
+		reply::get_connection_func_t session::make_connection_func(stream_ptr const& stream)
+		{
+			// 函数保存在stream的reply中, 只能弱引用stream
+			boost::weak_ptr<session> weak_self = shared_from_this();
+			boost::weak_ptr<stream_t> weak_stream = stream;
+			return [weak_self, weak_stream]() -> boost::shared_ptr<reply::connection>
+			{
+				auto self = weak_self.lock();
+				auto stream = weak_stream.lock();
+				auto owner = self ? self->owner_.lock() : boost::shared_ptr<void>();
+				if (!owner || !stream)
+				{
+					return boost::shared_ptr<reply::connection>();
+				}
+
+				auto& ios = self->ios_;
+				auto eof = [&ios](reply::handler_ec_size_t handler)
+				{
+					ios.post([handler] { handler(boost::asio::error::eof, 0); });
+				};
+				// body在调用handler前已经收齐, 没有更多可读的
+				return boost::make_shared<reply::connection>(stream->rep,
+					[self, owner, stream](const void* data, std::size_t size, reply::handler_ec_size_t handler)
+					{
+						self->delay_write(stream, std::string(static_cast<const char*>(data), size), std::move(handler));
+					},
+					[self, owner, stream](std::vector<boost::asio::const_buffer> const& buffers, reply::handler_ec_size_t handler)
+					{
+						std::string data;
+						data.reserve(boost::asio::buffer_size(buffers));
+						for (auto const& b : buffers)
+						{
+							data.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+						}
+						self->delay_write(stream, std::move(data), std::move(handler));
+					},
+					[eof](void*, std::size_t, reply::handler_ec_size_t handler) { eof(handler); },
+					[eof](void*, std::size_t, reply::handler_ec_size_t handler) { eof(handler); },
+					[&ios](reply::handler_strref_intptr_t handler)
+					{
+						ios.post([handler] { handler(boost::string_ref(), -1); });
+					},
+					[self, owner, stream](reply::handler_ec_t handler)
+					{
+						self->end_stream(stream);
+						self->ios_.post([handler] { handler(boost::system::error_code()); });
+					},
+					[self, owner, stream]()
+					{
+						self->ios_.dispatch([self, stream] { self->reset_stream(*stream, CANCEL); self->flush(); });
+					},
+					[self, owner, stream]() { return stream->local_closed || self->closing_; },
+					[self, owner, stream]() { self->end_stream(stream); },
+					reply::migrate_func_t(),
+					ios);
+			};
+		}
+
+		void session::delay_write(stream_ptr const& stream, std::string data, reply::handler_ec_size_t handler)
+		{
+			auto self = shared_from_this();
+			auto pending = boost::make_shared<pending_write_t>();
+			pending->data = std::move(data);
+			pending->handler = std::move(handler);
+			ios_.dispatch([self, this, stream, pending]
+			{
+				if (stream->local_closed || closing_)
+				{
+					if (pending->handler)
+					{
+						auto handler = std::move(pending->handler);
+						ios_.post([handler] { handler(boost::asio::error::broken_pipe, 0); });
+					}
+					return;
+				}
+
+				if (!stream->headers_sent)
+				{
+					stream->rep.set_chunked_framing(false);
+					send_headers(*stream, false);
+				}
+				stream->pending.push_back(std::move(*pending));
+				flush();
+			});
+		}
+
+		void session::end_stream(stream_ptr const& stream)
+		{
+			auto self = shared_from_this();
+			ios_.dispatch([self, this, stream]
+			{
+				if (stream->local_closed || stream->body_finished)
+				{
+					return;
+				}
+				if (!stream->headers_sent)
+				{
+					// 与HTTP/1.1相同, 延迟期间设置的body按普通回复发送
+					stream->delayed = false;
+					start_response(stream);
+				}
+				else
+				{
+					stream->body_finished = true;
+				}
+				flush();
+			});
+		}
+
+		bool session::pull_body(stream_ptr const& stream)
+		{
+			auto& rep = stream->rep;
+			if (rep.body_type() == reply::file_body)
+			{
+				// 大文件的下一块在blocking_io_pool中读, 读好后再来.
+				// 读取期间stream可能被RST_STREAM删掉, 由stream保持reply存活
+				auto self = shared_from_this();
+				if (!rep.prepare_file_body(ios_, stream, [self, this, stream]
+				{
+					stream->waiting_file = false;
+					flush();
+				}))
+				{
+					stream->waiting_file = true;
+					return false;
+				}
+			}
+
+			std::vector<boost::asio::const_buffer> buffers;
+			stream->body_finished = rep.body_to_buffers(buffers);
+			pending_write_t pending;
+			for (auto const& b : buffers)
+			{
+				pending.data.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+			}
+			if (!pending.data.empty())
+			{
+				stream->pending.push_back(std::move(pending));
+			}
+			if (!stream->body_finished && rep.body_type() == reply::file_body)
+			{
+				// 发送的同时预读下一块
+				rep.prepare_file_body(ios_, stream, {});
+			}
+			return true;
+		}
+
+		bool session::emit_data(stream_t& stream, std::size_t& budget)
+		{
+			if (stream.pending.empty())
+			{
+				if (!stream.body_finished)
+				{
+					return false;
+				}
+				// 最后一段已经发出, 补一个空的END_STREAM
+				frame_header(0, DATA, FLAG_END_STREAM, stream.id);
+				stream.local_closed = true;
+				return true;
+			}
+
+			auto& front = stream.pending.front();
+			auto remaining = front.data.size() - front.offset;
+			int64_t window = std::min(conn_send_window_, stream.send_window);
+			std::size_t n = std::min(remaining, std::min(peer_max_frame_size_, budget));
+			if (window <= 0 || n == 0)
+			{
+				return false;
+			}
+			if (static_cast<int64_t>(n) > window)
+			{
+				n = static_cast<std::size_t>(window);
+			}
+
+			bool last = n == remaining && stream.pending.size() == 1 && stream.body_finished;
+			frame_header(n, DATA, last ? FLAG_END_STREAM : 0, stream.id);
+			out_.append(front.data, front.offset, n);
+			front.offset += n;
+			conn_send_window_ -= n;
+			stream.send_window -= n;
+			budget -= std::min(budget, n + 9);
+
+			if (front.offset == front.data.size())
+			{
+				if (front.handler)
+				{
+					out_handlers_.emplace_back(std::move(front.handler), front.data.size());
+				}
+				stream.pending.pop_front();
+			}
+			if (last)
+			{
+				stream.local_closed = true;
+			}
+			return true;
+		}
+
+		void session::flush()
+		{
+			if (writing_)
+			{
+				// 写完后再来
+				return;
+			}
+
+			std::size_t budget = out_.size() < write_budget ? write_budget - out_.size() : 0;
+			bool progress = true;
+			while (budget > 0 && progress)
+			{
+				progress = false;
+				// 从上次发过的下一个stream开始, 每个stream一帧
+				auto it = streams_.upper_bound(last_served_);
+				for (std::size_t i = 0; i < streams_.size() && budget > 0; ++i, ++it)
+				{
+					if (it == streams_.end())
+					{
+						it = streams_.begin();
+					}
+
+					auto stream = it->second;
+					if (!stream->headers_sent || stream->local_closed || stream->waiting_file)
+					{
+						continue;
+					}
+					if (stream->pending.empty() && !stream->body_finished && !stream->delayed && !pull_body(stream))
+					{
+						continue;
+					}
+					if (emit_data(*stream, budget))
+					{
+						progress = true;
+						last_served_ = stream->id;
+					}
+				}
+
+				// 发完的stream在循环外删, 不影响迭代
+				for (auto s = streams_.begin(); s != streams_.end();)
+				{
+					auto& stream = *s->second;
+					if (stream.local_closed && stream.remote_closed)
+					{
+						release_body(stream);
+						s = streams_.erase(s);
+					}
+					else
+					{
+						++s;
+					}
+				}
+			}
+
+			if (out_.empty())
+			{
+				return;
+			}
+
+			writing_ = true;
+			writing_buffer_.swap(out_);
+			out_.clear();
+			auto handlers = boost::make_shared<std::vector<std::pair<reply::handler_ec_size_t, std::size_t>>>();
+			handlers->swap(out_handlers_);
+			auto self = shared_from_this();
+			write_(boost::asio::buffer(writing_buffer_), [self, this, handlers](boost::system::error_code const& ec)
+			{
+				writing_ = false;
+				for (auto& h : *handlers)
+				{
+					h.first(ec, ec ? 0 : h.second);
+				}
+
+				if (ec)
+				{
+					closing_ = true;
+					return;
+				}
+				if (closing_)
+				{
+					close_();
+					return;
+				}
+				flush();
+			});
+		}
+
+		void session::reset_stream(stream_t& stream, uint32_t error)
+		{
+			if (!stream.local_closed)
+			{
+				frame_header(4, RST_STREAM, 0, stream.id);
+				append_u32(out_, error);
+			}
+			stream.local_closed = true;
+			stream.remote_closed = true;
+			close_stream(stream);
+		}
+
+		void session::close_stream(stream_t& stream)
+		{
+			// 没写出去的延迟回复通知失败
+			for (auto& pending : stream.pending)
+			{
+				if (pending.handler)
+				{
+					auto handler = std::move(pending.handler);
+					ios_.post([handler] { handler(boost::asio::error::operation_aborted, 0); });
+				}
+			}
+			stream.pending.clear();
+			if (stream.local_closed && stream.remote_closed)
+			{
+				release_body(stream);
+				streams_.erase(stream.id);
+			}
+		}
+
+		bool session::connection_error(uint32_t error)
+		{
+			if (!closing_)
+			{
+				frame_header(8, GOAWAY, 0, 0);
+				append_u32(out_, last_stream_id_);
+				append_u32(out_, error);
+				closing_ = true;
+			}
+			return false;
+		}
+
+		void session::consumed(std::size_t length)
+		{
+			// 攒够半个窗口再发WINDOW_UPDATE
+			conn_recv_consumed_ += length;
+			if (conn_recv_consumed_ >= connection_window / 2)
+			{
+				window_update(0, conn_recv_consumed_);
+				conn_recv_window_ += conn_recv_consumed_;
+				conn_recv_consumed_ = 0;
+			}
+		}
+
+		void session::release_body(stream_t& stream)
+		{
+			consumed(stream.buffered);
+			stream.buffered = 0;
+		}
+
+		void session::window_update(uint32_t stream_id, std::size_t increment)
+		{
+			frame_header(4, WINDOW_UPDATE, 0, stream_id);
+			append_u32(out_, static_cast<uint32_t>(increment));
+		}
+
+		void session::frame_header(std::size_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
+		{
+			out_.push_back(static_cast<char>(length >> 16));
+			out_.push_back(static_cast<char>(length >> 8));
+			out_.push_back(static_cast<char>(length));
+			out_.push_back(static_cast<char>(type));
+			out_.push_back(static_cast<char>(flags));
+			append_u32(out_, stream_id);
+		}
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "request.hpp"
+#include "reply.hpp"
+#include "hpack.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace timax
+{
+	using request_handler_t = boost::function<void(const request& req, reply& rep)>;
+
+	namespace http2
+	{
+		// 明文连接上直接以"PRI * HTTP/2.0"开头的是prior knowledge的h2c
+		bool is_preface(const char* data, std::size_t length);
+		// 读到的还不够判断, 如只有"PRI * HTTP/2"
+		bool is_preface_prefix(const char* data, std::size_t length);
+
+		// ALPN中客户端提供h2时选h2, 否则http/1.1
+		void enable_alpn(boost::asio::ssl::context& ctx);
+		bool negotiated(SSL* ssl);
+
+		// 一个HTTP/2连接的协议部分, 不涉及socket: connection把读到的数据交给consume, 通过write_func_t写出.
+		// 每个stream有自己的request和reply, 收齐后调用request_handler_t, 与HTTP/1.1的接口相同.
+		// 只在连接的io线程中调用
+		class session
+			: public boost::enable_shared_from_this<session>,
+			private boost::noncopyable
+		{
+		public:
+			using write_func_t = boost::function<void(boost::asio::const_buffer, reply::handler_ec_t)>;
+			using close_func_t = boost::function<void()>;
+
+			// owner是底层的连接, 延迟回复(get_connection)期间保持它存活
+			session(boost::asio::io_service& ios, request_handler_t& handler, write_func_t write, close_func_t close, boost::weak_ptr<void> owner);
+
+			// 发出我们的SETTINGS, data是连接已经读到的数据(h2c的preface)
+			void start(const char* data, std::size_t length);
+
+			// 返回false表示连接出错, 发完GOAWAY后关闭, 不要再读
+			bool consume(const char* data, std::size_t length);
+
+		private:
+			struct pending_write_t
+			{
+				std::string data;
+				std::size_t offset = 0;
+				// 延迟回复的async_write, 写出后调用
+				reply::handler_ec_size_t handler;
+			};
+
+			struct stream_t
+			{
+				uint32_t id = 0;
+				// 收到了END_STREAM
+				bool remote_closed = false;
+				// 发出了END_STREAM或RST_STREAM
+				bool local_closed = false;
+				bool headers_sent = false;
+				// reply的body已经全部取出
+				bool body_finished = false;
+				bool head = false;
+				// 回复通过reply::connection写出
+				bool delayed = false;
+				bool waiting_file = false;
+				int64_t send_window = 0;
+				// 给对方的窗口
+				int64_t recv_window = 0;
+				// 收到的body(包括已经转入req的), stream删除时才还给连接的窗口
+				std::size_t buffered = 0;
+				std::vector<header_field_t> headers;
+				std::string body;
+				std::deque<pending_write_t> pending;
+				request req;
+				reply rep;
+			};
+			using stream_ptr = boost::shared_ptr<stream_t>;
+
+			bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length);
+			bool handle_data(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length);
+			bool handle_headers(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length);
+			bool handle_settings(uint8_t flags, uint32_t stream_id, const unsigned char* payload, std::size_t length);
+			bool handle_window_update(uint32_t stream_id, const unsigned char* payload, std::size_t length);
+			bool process_headers(uint32_t stream_id, bool end_stream);
+
+			void dispatch(stream_ptr const& stream);
+			bool build_request(stream_t& stream);
+			void start_response(stream_ptr const& stream);
+			void send_headers(stream_t& stream, bool end_stream);
+			reply::get_connection_func_t make_connection_func(stream_ptr const& stream);
+
+			// 延迟回复, 可能在别的线程调用
+			void delay_write(stream_ptr const& stream, std::string data, reply::handler_ec_size_t handler);
+			void end_stream(stream_ptr const& stream);
+
+			bool pull_body(stream_ptr const& stream);
+			bool emit_data(stream_t& stream, std::size_t& budget);
+			void flush();
+
+			void reset_stream(stream_t& stream, uint32_t error);
+			void close_stream(stream_t& stream);
+			bool connection_error(uint32_t error);
+			void window_update(uint32_t stream_id, std::size_t increment);
+			// length字节的DATA不再占用我们的内存, 可以还给连接的窗口
+			void consumed(std::size_t length);
+			void release_body(stream_t& stream);
+			void frame_header(std::size_t length, uint8_t type, uint8_t flags, uint32_t stream_id);
+
+			boost::asio::io_service& ios_;
+			request_handler_t& handler_;
+			write_func_t write_;
+			close_func_t close_;
+			boost::weak_ptr<void> owner_;
+
+			std::string in_;
+			bool preface_received_ = false;
+			hpack_decoder decoder_;
+
+			// 等CONTINUATION的头部块
+			uint32_t continuation_stream_ = 0;
+			bool continuation_end_stream_ = false;
+			std::string header_block_;
+
+			std::map<uint32_t, stream_ptr> streams_;
+			uint32_t last_stream_id_ = 0;
+			// 轮流给各个stream发DATA
+			uint32_t last_served_ = 0;
+
+			// 对方的设置
+			std::size_t peer_max_frame_size_ = 16384;
+			int64_t peer_initial_window_ = 65535;
+			int64_t conn_send_window_ = 65535;
+			int64_t conn_recv_window_ = 65535;
+			std::size_t conn_recv_consumed_ = 0;
+
+			// 控制帧和HEADERS直接追加, DATA在flush中按流控追加
+			std::string out_;
+			std::vector<std::pair<reply::handler_ec_size_t, std::size_t>> out_handlers_;
+			std::string writing_buffer_;
+			bool writing_ = false;
+			// 发了GOAWAY, 写完后关闭
+			bool closing_ = false;
+		};
+	}
+}
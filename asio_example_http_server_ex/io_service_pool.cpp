@@ -1,5 +1,6 @@
 
 #include "server.hpp"
+#include "connection_balancer.hpp"
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
@@ -41,6 +42,36 @@ namespace timax
 			threads[i]->join();
 	}
 
+	void io_service_pool::enable_rebalance(std::size_t interval_ms)
+	{
+		rebalance_interval_ms_ = interval_ms;
+		if (interval_ms == 0 || rebalance_timer_)
+		{
+			return;
+		}
+
+		rebalance_timer_.reset(new boost::asio::deadline_timer(*io_services_[0]));
+		start_rebalance_timer();
+	}
+
+	void io_service_pool::start_rebalance_timer()
+	{
+		rebalance_timer_->expires_from_now(boost::posix_time::milliseconds(rebalance_interval_ms_));
+		rebalance_timer_->async_wait([this](boost::system::error_code const& ec)
+		{
+			if (ec || rebalance_interval_ms_ == 0)
+			{
+				return;
+			}
+
+			std::vector<boost::asio::io_service*> services;
+			for (std::size_t i = 0; i < io_services_.size(); ++i)
+				services.push_back(io_services_[i].get());
+			connection_balancer::rebalance(services);
+			start_rebalance_timer();
+		});
+	}
+
 	void io_service_pool::stop()
 	{
 		// Explicitly stop all io_services.
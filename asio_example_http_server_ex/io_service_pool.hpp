@@ -26,6 +26,10 @@ namespace timax
 		/// Get an io_service to use.
 		boost::asio::io_service& get_io_service();
 
+		/// Periodically move idle long-lived connections from the io_service holding the
+		/// most of them to the one holding the fewest. Call before run().
+		void enable_rebalance(std::size_t interval_ms);
+
 	private:
 		typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
 		typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
@@ -38,6 +42,12 @@ namespace timax
 
 		/// The next io_service to use for a connection.
 		std::size_t next_io_service_;
+
+		void start_rebalance_timer();
+
+		/// Runs on the first io_service, 0 interval when rebalancing is off.
+		boost::shared_ptr<boost::asio::deadline_timer> rebalance_timer_;
+		std::size_t rebalance_interval_ms_ = 0;
 	};
 
 }
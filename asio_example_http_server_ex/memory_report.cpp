@@ -0,0 +1,75 @@
+#include "memory_report.hpp"
+
+#include <sstream>
+
+namespace timax
+{
+	std::atomic<bool> memory_report::idle_release_{ false };
+	std::atomic<std::size_t> memory_report::connections_{ 0 };
+	std::atomic<std::size_t> memory_report::tls_connections_{ 0 };
+	std::atomic<std::size_t> memory_report::parked_{ 0 };
+	std::atomic<std::size_t> memory_report::parked_tls_{ 0 };
+	std::atomic<std::size_t> memory_report::http2_connections_{ 0 };
+	std::atomic<std::ptrdiff_t> memory_report::request_buffers_{ 0 };
+
+	void memory_report::connection_opened(bool tls)
+	{
+		++connections_;
+		if (tls)
+		{
+			++tls_connections_;
+		}
+	}
+
+	void memory_report::connection_closed(bool tls)
+	{
+		--connections_;
+		if (tls)
+		{
+			--tls_connections_;
+		}
+	}
+
+	void memory_report::connection_parked(bool parked)
+	{
+		if (parked)
+		{
+			++parked_;
+		}
+		else
+		{
+			--parked_;
+		}
+	}
+
+	void memory_report::http2_started()
+	{
+		++http2_connections_;
+	}
+
+	void memory_report::http2_closed()
+	{
+		--http2_connections_;
+	}
+
+	void memory_report::request_buffer_changed(std::ptrdiff_t delta)
+	{
+		request_buffers_ += delta;
+	}
+
+	std::string memory_report::summary()
+	{
+		std::size_t tls = tls_connections_;
+		// 空闲内存模式下OpenSSL的记录缓冲区只在有数据时存在, 不计入
+		std::size_t tls_bytes = tls * (tls_stream_buffers + (idle_release_ ? 0 : tls_record_buffers));
+
+		std::ostringstream oss;
+		oss << "connections " << connections_
+			<< " (tls " << tls << ", http/2 " << http2_connections_ << ")"
+			<< ", parked " << parked_
+			<< ", request buffers " << request_buffers_ / 1024 << "K"
+			<< ", tls buffers ~" << tls_bytes / 1024 << "K"
+			<< (idle_release_ ? ", idle release on" : ", idle release off");
+		return oss.str();
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+namespace timax
+{
+	// 连接占用内存的统计和空闲内存模式. 计数在任何线程更新, 只用原子操作
+	class memory_report
+	{
+	public:
+		// 空闲内存模式: 等下一个请求的长连接释放请求和回复的缓冲区, 不带缓冲区等socket可读;
+		// TLS监听使用SSL_MODE_RELEASE_BUFFERS, OpenSSL在记录缓冲区为空时释放它们. 要在listen之前设置
+		static void set_idle_release(bool enable)
+		{
+			idle_release_ = enable;
+		}
+		static bool idle_release()
+		{
+			return idle_release_;
+		}
+
+		// 一个连接占用的内存, 字节
+		struct usage_t
+		{
+			std::size_t request = 0;
+			std::size_t reply = 0;
+			// 读chunked请求的缓冲区和HTTP/2的读缓冲区
+			std::size_t read_buffer = 0;
+			// boost::asio和OpenSSL的TLS缓冲区, 估计值
+			std::size_t tls = 0;
+			bool parked = false;
+
+			std::size_t total() const
+			{
+				return request + reply + read_buffer + tls;
+			}
+		};
+
+		// boost::asio的ssl::stream固定有两个17K的缓冲区, 与OpenSSL之间的BIO pair两端各17K
+		static const std::size_t tls_stream_buffers = 4 * 17 * 1024;
+		// OpenSSL的读写记录缓冲区, 不释放时一直占用
+		static const std::size_t tls_record_buffers = 34 * 1024;
+
+		static void connection_opened(bool tls);
+		static void connection_closed(bool tls);
+		static void connection_parked(bool parked);
+		static void http2_started();
+		static void http2_closed();
+		// 所有request的缓冲区, 包括HTTP/2的stream
+		static void request_buffer_changed(std::ptrdiff_t delta);
+
+		// 一行的汇总: 连接数, 停放的连接数, 请求缓冲区和TLS缓冲区的总量
+		static std::string summary();
+
+	private:
+		static std::atomic<bool> idle_release_;
+		static std::atomic<std::size_t> connections_;
+		static std::atomic<std::size_t> tls_connections_;
+		static std::atomic<std::size_t> parked_;
+		static std::atomic<std::size_t> parked_tls_;
+		static std::atomic<std::size_t> http2_connections_;
+		static std::atomic<std::ptrdiff_t> request_buffers_;
+	};
+}
@@ -1,12 +1,29 @@
 ﻿
 #include "mime_types.hpp"
-#include <map>
+#include "perfect_hash.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <deque>
+#include <fstream>
+#include <vector>
 
 namespace timax
 {
 	namespace mime_types
 	{
-		std::map<std::string, std::string> mime_map = 
+		namespace
+		{
+			struct mime_entry_t
+			{
+				const char* extension;
+				const char* type;
+			};
+		}
+
+		// 加载的mime.types覆盖这里的同名扩展名
+		static const mime_entry_t builtin_types[] =
 		{
 			{ ".323", "text/h323" },
 			{ ".3gp", "video/3gpp" },
@@ -36,7 +53,7 @@ namespace timax
 			{ ".axs", "application/olescript" },
 			{ ".bas", "text/plain" },
 			{ ".bcpio", "application/x-bcpio" },
-			{ ".bin ", "application/octet-stream" },
+			{ ".bin", "application/octet-stream" },
 			{ ".bld", "application/bld" },
 			{ ".bld2", "application/bld2" },
 			{ ".bmp", "image/bmp" },
@@ -276,7 +293,7 @@ namespace timax
 			{ ".png", "image/png" },
 			{ ".pnm", "image/x-portable-anymap" },
 			{ ".pnz", "image/png" },
-			{ ".pot,", "application/vnd.ms-powerpoint" },
+			{ ".pot", "application/vnd.ms-powerpoint" },
 			{ ".ppm", "image/x-portable-pixmap" },
 			{ ".pps", "application/vnd.ms-powerpoint" },
 			{ ".ppt", "application/vnd.ms-powerpoint" },
@@ -363,7 +380,6 @@ namespace timax
 			{ ".stk", "application/hyperstudio" },
 			{ ".stl", "application/vnd.ms-pkistl" },
 			{ ".stm", "text/html" },
-			{ ".svg", "image/svg+xml" },
 			{ ".sv4cpio", "application/x-sv4cpio" },
 			{ ".sv4crc", "application/x-sv4crc" },
 			{ ".svf", "image/vnd" },
@@ -475,7 +491,6 @@ namespace timax
 			{ ".xlt", "application/vnd.ms-excel" },
 			{ ".xlw", "application/vnd.ms-excel" },
 			{ ".xm", "audio/x-mod" },
-			{ ".xml","text/plain" },
 			{ ".xml","application/xml" },
 			{ ".xmz", "audio/x-mod" },
 			{ ".xof", "x-world/x-vrml" },
@@ -493,17 +508,229 @@ namespace timax
 			{ ".json", "application/json" },
 		};
 
-		// TODO: 添加加载mime的函数
-		std::string extension_to_type(const std::string& extension)
+		namespace
 		{
-			auto it = mime_map.find(extension);
-			if (it == mime_map.end())
+			char to_lower(char c)
 			{
-				return "application/octet-stream";
+				return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			}
+
+			// 大小写无关
+			uint32_t hash(boost::string_ref key, uint32_t seed)
+			{
+				return perfect_hash::hash(key, seed, to_lower);
+			}
+
+			bool iequals(boost::string_ref a, boost::string_ref b)
+			{
+				return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+				{
+					return to_lower(x) == to_lower(y);
+				});
+			}
+
+			// 扩展名(不含'.')到类型的最小完美哈希: 先按hash(ext, 0)分桶, 每个桶一个seed,
+			// 查找只需两次哈希和一次比较. 表只在启动时构建, 之后只读
+			class mime_table
+			{
+			public:
+				struct entry_t
+				{
+					boost::string_ref extension;
+					boost::string_ref type;
+				};
+
+				mime_table()
+				{
+					for (auto const& e : builtin_types)
+					{
+						add(e.extension, e.type);
+					}
+					auto built = build();
+					assert(built);
+					(void)built;
+				}
+
+				boost::string_ref find(boost::string_ref extension) const
+				{
+					if (!extension.empty() && extension.front() == '.')
+					{
+						extension.remove_prefix(1);
+					}
+					if (extension.empty() || slots_.empty())
+					{
+						return{};
+					}
+
+					auto seed = seeds_[hash(extension, 0) % seeds_.size()];
+					auto const& slot = slots_[hash(extension, seed) % slots_.size()];
+					return iequals(slot.extension, extension) ? slot.type : boost::string_ref();
+				}
+
+				// 后加的覆盖先加的
+				void add(boost::string_ref extension, boost::string_ref type)
+				{
+					if (!extension.empty() && extension.front() == '.')
+					{
+						extension.remove_prefix(1);
+					}
+					if (extension.empty() || type.empty())
+					{
+						return;
+					}
+
+					std::string ext(extension.size(), '\0');
+					std::transform(extension.begin(), extension.end(), ext.begin(), to_lower);
+					strings_.push_back(std::move(ext));
+					boost::string_ref key = strings_.back();
+					strings_.push_back(type.to_string());
+					boost::string_ref value = strings_.back();
+
+					auto it = std::find_if(entries_.begin(), entries_.end(), [key](entry_t const& e) { return e.extension == key; });
+					if (it != entries_.end())
+					{
+						it->type = value;
+					}
+					else
+					{
+						entries_.push_back(entry_t{ key, value });
+					}
+				}
+
+				// 找不到完美哈希时返回false, 原来的表不变
+				bool build()
+				{
+					std::vector<uint32_t> seeds;
+					std::vector<int> slots;
+					if (!perfect_hash::build(entries_.size(), [this](std::size_t i, uint32_t seed)
+					{
+						return hash(entries_[i].extension, seed);
+					}, seeds, slots))
+					{
+						return false;
+					}
+
+					slots_.assign(slots.size(), entry_t{});
+					for (std::size_t i = 0; i < slots.size(); ++i)
+					{
+						if (slots[i] != -1)
+						{
+							slots_[i] = entries_[slots[i]];
+						}
+					}
+					seeds_ = std::move(seeds);
+					return true;
+				}
+
+				// load失败时回到加载前的扩展名
+				std::vector<entry_t> const& entries() const
+				{
+					return entries_;
+				}
+				void restore(std::vector<entry_t> entries)
+				{
+					entries_ = std::move(entries);
+				}
+
+			private:
+				// deque中的字符串地址不变, string_ref可以一直使用
+				std::deque<std::string> strings_;
+				std::vector<entry_t> entries_;
+				std::vector<entry_t> slots_;
+				std::vector<uint32_t> seeds_;
+			};
+
+			mime_table& table()
+			{
+				static mime_table t;
+				return t;
 			}
+		}
 
-			return it->second;
+		boost::string_ref extension_to_type(boost::string_ref extension)
+		{
+			auto type = table().find(extension);
+			if (type.empty())
+			{
+				return "application/octet-stream";
+			}
+			return type;
 		}
 
+		bool load(std::string const& path)
+		{
+			std::ifstream ifs(path);
+			if (!ifs)
+			{
+				return false;
+			}
+
+			// 同时支持apache的"type ext1 ext2"按行格式和nginx的"types { type ext1 ext2; }"格式,
+			// 出现'{'后按nginx格式以';'结束一条, 一条可以跨行
+			auto& t = table();
+			auto saved = t.entries();
+			bool nginx = false;
+			std::string line;
+			std::vector<std::string> tokens;
+			auto flush = [&t, &tokens]
+			{
+				if (tokens.size() >= 2 && tokens[0].find('/') != std::string::npos)
+				{
+					for (std::size_t i = 1; i < tokens.size(); ++i)
+					{
+						t.add(tokens[i], tokens[0]);
+					}
+				}
+				tokens.clear();
+			};
+
+			while (std::getline(ifs, line))
+			{
+				auto comment = line.find('#');
+				if (comment != std::string::npos)
+				{
+					line.resize(comment);
+				}
+
+				std::string token;
+				for (auto c : line)
+				{
+					if (std::isspace(static_cast<unsigned char>(c)) || c == ';' || c == '{' || c == '}')
+					{
+						if (!token.empty() && token != "types")
+						{
+							tokens.push_back(token);
+						}
+						token.clear();
+						if (c == '{')
+						{
+							nginx = true;
+						}
+						if (c == ';' || c == '{' || c == '}')
+						{
+							flush();
+						}
+						continue;
+					}
+					token += c;
+				}
+				if (!token.empty() && token != "types")
+				{
+					tokens.push_back(token);
+				}
+
+				if (!nginx)
+				{
+					flush();
+				}
+			}
+			flush();
+			if (!t.build())
+			{
+				t.restore(std::move(saved));
+				return false;
+			}
+			return true;
+		}
 	}
-}
\ No newline at end of file
+}
@@ -1,12 +1,20 @@
 ﻿
 #pragma once
 
+#include <boost/utility/string_ref.hpp>
+
 #include <string>
 
 namespace timax
 {
 	namespace mime_types
 	{
-		std::string extension_to_type(const std::string& extension);
+		// ".html"或"html", 不区分大小写, 未知的扩展名返回application/octet-stream.
+		// 返回的string_ref一直有效
+		boost::string_ref extension_to_type(boost::string_ref extension);
+
+		// 加载apache或nginx格式的mime.types, 覆盖内置的同名扩展名. 只能在启动时调用.
+		// 文件打不开或者找不到完美哈希时返回false, 表保持加载前的内容
+		bool load(std::string const& path);
 	}
-}
\ No newline at end of file
+}
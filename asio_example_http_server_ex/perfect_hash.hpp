@@ -0,0 +1,116 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace timax
+{
+	/// Minimal perfect hashing (hash and displace) for tables built once and then only read:
+	/// the packed assets and the MIME types.
+	namespace perfect_hash
+	{
+		/// Seeds tried per bucket before giving up.
+		const uint32_t max_seed = 0x1000000;
+
+		/// FNV-1a with a seed. The seed flips the low bits of plain FNV-1a the same way for every key,
+		/// so the result goes through murmur3's finalizer before it is reduced to a slot.
+		/// map is applied to every character, e.g. to hash case-insensitively.
+		template <typename CharMap>
+		inline uint32_t hash(boost::string_ref key, uint32_t seed, CharMap map)
+		{
+			uint32_t h = 2166136261u ^ seed;
+			for (auto c : key)
+			{
+				h ^= static_cast<unsigned char>(map(c));
+				h *= 16777619u;
+			}
+			h ^= h >> 16;
+			h *= 0x85ebca6bu;
+			h ^= h >> 13;
+			h *= 0xc2b2ae35u;
+			h ^= h >> 16;
+			return h;
+		}
+
+		inline uint32_t hash(boost::string_ref key, uint32_t seed)
+		{
+			return hash(key, seed, [](char c) { return c; });
+		}
+
+		/// Place n keys, key_hash(i, seed) is the hash of key i. Keys are bucketed by key_hash(i, 0),
+		/// then every bucket, the biggest first, gets a seed that sends all its keys to free slots.
+		/// seeds gets max(1, n / 2 + 1) entries and slots max(1, n), slots holds key indexes or -1.
+		/// A lookup is seeds[hash(key, 0) % seeds.size()], then slots[hash(key, seed) % slots.size()].
+		/// Return false if some bucket has no seed below max_seed.
+		template <typename KeyHash>
+		bool build(std::size_t n, KeyHash key_hash, std::vector<uint32_t>& seeds, std::vector<int>& slots)
+		{
+			seeds.assign(std::max<std::size_t>(1, n / 2 + 1), 0);
+			slots.assign(std::max<std::size_t>(1, n), -1);
+			if (n == 0)
+			{
+				return true;
+			}
+
+			std::vector<std::vector<int>> buckets(seeds.size());
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				buckets[key_hash(i, 0) % seeds.size()].push_back(static_cast<int>(i));
+			}
+
+			std::vector<std::size_t> order(buckets.size());
+			for (std::size_t i = 0; i < order.size(); ++i)
+			{
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [&buckets](std::size_t a, std::size_t b)
+			{
+				return buckets[a].size() > buckets[b].size();
+			});
+
+			std::vector<std::size_t> taken;
+			for (auto b : order)
+			{
+				auto const& bucket = buckets[b];
+				if (bucket.empty())
+				{
+					break;
+				}
+
+				for (uint32_t seed = 1;; ++seed)
+				{
+					if (seed == max_seed)
+					{
+						return false;
+					}
+
+					taken.clear();
+					for (auto i : bucket)
+					{
+						auto slot = key_hash(static_cast<std::size_t>(i), seed) % n;
+						if (slots[slot] != -1 || std::find(taken.begin(), taken.end(), slot) != taken.end())
+						{
+							break;
+						}
+						taken.push_back(slot);
+					}
+
+					if (taken.size() == bucket.size())
+					{
+						for (std::size_t k = 0; k < bucket.size(); ++k)
+						{
+							slots[taken[k]] = bucket[k];
+						}
+						seeds[b] = seed;
+						break;
+					}
+				}
+			}
+			return true;
+		}
+	}
+}
@@ -1,10 +1,17 @@
 ﻿
 #include "reply.hpp"
+#include "request.hpp"
 #include "utils.h"
 #include "mime_types.hpp"
+#include "blocking_io_pool.hpp"
+#include "embedded_assets.hpp"
 
+#include <boost/algorithm/string/find.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <random>
 #include <string>
 #include <fcntl.h>
 #ifdef _MSC_VER
@@ -25,6 +32,8 @@ namespace timax
 			"HTTP/1.1 202 Accepted\r\n";
 		const std::string no_content =
 			"HTTP/1.1 204 No Content\r\n";
+		const std::string partial_content =
+			"HTTP/1.1 206 Partial Content\r\n";
 		const std::string multiple_choices =
 			"HTTP/1.1 300 Multiple Choices\r\n";
 		const std::string moved_permanently =
@@ -41,6 +50,8 @@ namespace timax
 			"HTTP/1.1 403 Forbidden\r\n";
 		const std::string not_found =
 			"HTTP/1.1 404 Not Found\r\n";
+		const std::string range_not_satisfiable =
+			"HTTP/1.1 416 Range Not Satisfiable\r\n";
 		const std::string internal_server_error =
 			"HTTP/1.1 500 Internal Server Error\r\n";
 		const std::string not_implemented =
@@ -64,6 +75,8 @@ namespace timax
 				return boost::asio::buffer(accepted);
 			case reply::no_content:
 				return boost::asio::buffer(no_content);
+			case reply::partial_content:
+				return boost::asio::buffer(partial_content);
 			case reply::multiple_choices:
 				return boost::asio::buffer(multiple_choices);
 			case reply::moved_permanently:
@@ -80,6 +93,8 @@ namespace timax
 				return boost::asio::buffer(forbidden);
 			case reply::not_found:
 				return boost::asio::buffer(not_found);
+			case reply::range_not_satisfiable:
+				return boost::asio::buffer(range_not_satisfiable);
 			case reply::internal_server_error:
 				return boost::asio::buffer(internal_server_error);
 			case reply::not_implemented:
@@ -100,8 +115,51 @@ namespace timax
 
 		const char name_value_separator[] = { ':', ' ' };
 		const char crlf[] = { '\r', '\n' };
+		const std::string chunked_end = "0\r\n\r\n";
 	} // namespace misc_strings
 
+	void reply::append_chunk(std::vector<boost::asio::const_buffer>& buffers, std::string const& data)
+	{
+		if (!chunked_framing_)
+		{
+			buffers.emplace_back(boost::asio::buffer(data));
+			return;
+		}
+
+		// chunked编码中分段的长度
+		static const char hex_lookup[] = "0123456789abcdef";
+		size_t content_len = data.size();
+		int hex_len = 0;
+		if (content_len == 0)
+		{
+			hex_len = 1;
+		}
+		for (auto tmp = content_len; tmp != 0; tmp >>= 4)
+		{
+			++hex_len;
+		}
+
+		chunked_len_buf_[hex_len] = '\r';
+		chunked_len_buf_[hex_len + 1] = '\n';
+
+		auto tmp = hex_len;
+		for (--tmp; tmp >= 0; content_len >>= 4, --tmp)
+		{
+			chunked_len_buf_[tmp] = hex_lookup[content_len & 0xf];
+		}
+		buffers.emplace_back(boost::asio::buffer(chunked_len_buf_, hex_len + 2));
+		buffers.emplace_back(boost::asio::buffer(data));
+		buffers.emplace_back(boost::asio::buffer(misc_strings::crlf));
+	}
+
+	void reply::append_chunked_end(std::vector<boost::asio::const_buffer>& buffers)
+	{
+		if (chunked_framing_)
+		{
+			buffers.emplace_back(boost::asio::buffer(misc_strings::chunked_end));
+		}
+	}
+
 	bool reply::to_buffers(std::vector<boost::asio::const_buffer>& buffers)
 	{
 		if (!header_buffer_wroted_)
@@ -119,7 +177,11 @@ namespace timax
 			buffers.push_back(boost::asio::buffer(misc_strings::crlf));
 			header_buffer_wroted_ = true;
 		}
-		
+		return body_to_buffers(buffers);
+	}
+
+	bool reply::body_to_buffers(std::vector<boost::asio::const_buffer>& buffers)
+	{
 		switch (body_type_)
 		{
 		case reply::none:
@@ -127,49 +189,74 @@ namespace timax
 		case reply::string_body:
 			buffers.emplace_back(boost::asio::buffer(content_));
 			return true;
+		case reply::buffer_body:
+			buffers.emplace_back(buffer_body_);
+			return true;
 		case reply::file_body:
-		{
-			content_.resize(1024 * 1024);
-			fs_.read(&content_[0], content_.size());
-			buffers.emplace_back(boost::asio::buffer(content_.data(), static_cast<std::size_t>(fs_.gcount())));
-			return fs_.eof();
-		}
-			break;
-		case reply::chunked_body:
-			content_ = content_gen_();
-			if (content_.empty())
 			{
-				static const std::string chunked_end = "0\r\n\r\n";
-				buffers.emplace_back(boost::asio::buffer(chunked_end));
-				return true;
-			}
-
-			{
-				// chunked编码中分段的长度
-				static const char hex_lookup[] = "0123456789abcdef";
-				size_t content_len = content_.size();
-				int hex_len = 0;
-				if (content_len == 0)
+				file_block_t* block;
+				if (file_async_)
+				{
+					// prepare_file_body已经读好了这一块
+					assert(file_ready_ != -1);
+					block = &file_blocks_[file_ready_];
+					file_ready_ = -1;
+				}
+				else
 				{
-					hex_len = 1;
+					block = &file_blocks_[0];
+					fill_file_block(*block);
 				}
-				for (auto tmp = content_len; tmp != 0; tmp >>= 4)
+
+				auto finished = block->finished;
+				if (!deflater_)
 				{
-					++hex_len;
+					buffers.insert(buffers.end(), block->buffers.begin(), block->buffers.end());
+					return finished;
 				}
 
-				chunked_len_buf_[hex_len] = '\r';
-				chunked_len_buf_[hex_len + 1] = '\n';
+				compress_buf_.clear();
+				for (auto const& buf : block->buffers)
+				{
+					deflater_->write(boost::asio::buffer_cast<const void*>(buf), boost::asio::buffer_size(buf), Z_NO_FLUSH, compress_buf_);
+				}
+				if (finished)
+				{
+					deflater_->write(nullptr, 0, Z_FINISH, compress_buf_);
+				}
 
-				auto tmp = hex_len;
-				for (--tmp; tmp >= 0; content_len >>= 4, --tmp)
+				if (!compress_buf_.empty())
 				{
-					chunked_len_buf_[tmp] = hex_lookup[content_len & 0xf];
+					append_chunk(buffers, compress_buf_);
 				}
-				buffers.emplace_back(boost::asio::buffer(chunked_len_buf_, hex_len + 2));
+				if (finished)
+				{
+					append_chunked_end(buffers);
+				}
+				return finished;
+			}
+		case reply::chunked_body:
+			content_ = content_gen_();
+			if (deflater_)
+			{
+				// 每个分段都sync flush, 生成器产生的数据不会被压缩流攒住
+				compress_buf_.clear();
+				deflater_->write(content_.data(), content_.size(), content_.empty() ? Z_FINISH : Z_SYNC_FLUSH, compress_buf_);
+				if (!compress_buf_.empty())
+				{
+					append_chunk(buffers, compress_buf_);
+				}
+			}
+			else if (!content_.empty())
+			{
+				append_chunk(buffers, content_);
+			}
+
+			if (content_.empty())
+			{
+				append_chunked_end(buffers);
+				return true;
 			}
-			buffers.emplace_back(boost::asio::buffer(content_));
-			buffers.emplace_back(boost::asio::buffer(misc_strings::crlf));
 			return false;
 		default:
 			assert(false);
@@ -235,6 +322,11 @@ namespace timax
 			"<head><title>Not Found</title></head>"
 			"<body><h1>404 Not Found</h1></body>"
 			"</html>";
+		const char range_not_satisfiable[] =
+			"<html>"
+			"<head><title>Range Not Satisfiable</title></head>"
+			"<body><h1>416 Range Not Satisfiable</h1></body>"
+			"</html>";
 		const char internal_server_error[] =
 			"<html>"
 			"<head><title>Internal Server Error</title></head>"
@@ -284,6 +376,8 @@ namespace timax
 				return forbidden;
 			case reply::not_found:
 				return not_found;
+			case reply::range_not_satisfiable:
+				return range_not_satisfiable;
 			case reply::internal_server_error:
 				return internal_server_error;
 			case reply::not_implemented:
@@ -319,8 +413,58 @@ namespace timax
 		body_type_ = none;
 		headers_.clear();
 		content_.clear();
-		fs_.close();
+		file_.reset();
+		file_handle_.reset();
+		file_ranges_.clear();
+		file_range_index_ = 0;
+		file_offset_ = 0;
+		file_remain_ = 0;
+		file_left_ = 0;
+		file_trailer_.clear();
+		for (auto& block : file_blocks_)
+		{
+			std::string().swap(block.data);
+			block.buffers.clear();
+			block.finished = false;
+		}
+		file_async_ = false;
+		file_filling_ = false;
+		file_ready_ = -1;
+		file_next_ = 0;
+		file_waiter_ = {};
 		content_gen_ = {};
+		buffer_body_ = {};
+		deflater_.reset();
+		compress_buf_.clear();
+	}
+
+	void reply::release_memory()
+	{
+		reset();
+		std::vector<header_t>().swap(headers_);
+		std::string().swap(content_);
+		std::vector<file_range_t>().swap(file_ranges_);
+		std::string().swap(file_trailer_);
+		for (auto& block : file_blocks_)
+		{
+			std::vector<boost::asio::const_buffer>().swap(block.buffers);
+		}
+		std::string().swap(compress_buf_);
+	}
+
+	std::size_t reply::memory_usage() const
+	{
+		auto size = headers_.capacity() * sizeof(header_t) + content_.capacity()
+			+ file_trailer_.capacity() + compress_buf_.capacity();
+		for (auto& header : headers_)
+		{
+			size += header.name.capacity() + header.value.capacity();
+		}
+		for (auto& block : file_blocks_)
+		{
+			size += block.data.capacity() + block.buffers.capacity() * sizeof(boost::asio::const_buffer);
+		}
+		return size;
 	}
 
 	void reply::set_status(status_type status)
@@ -487,32 +631,673 @@ namespace timax
 		content_ = std::move(body);
 	}
 
+	namespace byte_ranges
+	{
+		enum result_t
+		{
+			ignore,
+			unsatisfiable,
+			satisfiable
+		};
+
+		// 最多接受的range数量,防止大量重叠的小range放大IO
+		const std::size_t max_ranges = 16;
+
+		bool parse_number(const char*& p, const char* end, uint64_t& n)
+		{
+			auto begin = p;
+			n = 0;
+			for (; p != end && *p >= '0' && *p <= '9'; ++p)
+			{
+				if (n > (UINT64_MAX - 9) / 10)
+				{
+					return false;
+				}
+				n = n * 10 + (*p - '0');
+			}
+			return p != begin;
+		}
+
+		// Range: bytes=0-499, 500-, -500
+		result_t parse(boost::string_ref value, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+		{
+			if (value.size() < 6 || !iequal(value.data(), 6, "bytes=", 6))
+			{
+				return ignore;
+			}
+
+			auto p = value.data() + 6;
+			auto end = value.data() + value.size();
+			bool has_spec = false;
+			while (p != end)
+			{
+				while (p != end && (*p == ' ' || *p == '\t' || *p == ','))
+				{
+					++p;
+				}
+				if (p == end)
+				{
+					break;
+				}
+
+				uint64_t first = 0, last = 0;
+				bool suffix = *p == '-';
+				if (suffix)
+				{
+					++p;
+					if (!parse_number(p, end, last))
+					{
+						return ignore;
+					}
+				}
+				else
+				{
+					if (!parse_number(p, end, first) || p == end || *p++ != '-')
+					{
+						return ignore;
+					}
+					if (p == end || *p == ',' || *p == ' ' || *p == '\t')
+					{
+						last = UINT64_MAX;
+					}
+					else if (!parse_number(p, end, last) || last < first)
+					{
+						return ignore;
+					}
+				}
+
+				while (p != end && (*p == ' ' || *p == '\t'))
+				{
+					++p;
+				}
+				if (p != end && *p != ',')
+				{
+					return ignore;
+				}
+
+				has_spec = true;
+				if (suffix)
+				{
+					if (last == 0 || size == 0)
+					{
+						continue;
+					}
+					first = size - std::min(last, size);
+					last = size - 1;
+				}
+				else
+				{
+					if (first >= size)
+					{
+						continue;
+					}
+					last = std::min(last, size - 1);
+				}
+
+				if (ranges.size() == max_ranges)
+				{
+					return ignore;
+				}
+				ranges.emplace_back(first, last);
+			}
+
+			if (!has_spec)
+			{
+				return ignore;
+			}
+			return ranges.empty() ? unsatisfiable : satisfiable;
+		}
+
+		// If-Range只接受强校验的ETag或完全相同的Last-Modified
+		bool if_range_matches(boost::string_ref if_range, file_info const& info)
+		{
+			if (if_range.empty())
+			{
+				return true;
+			}
+			if (if_range.starts_with("W/"))
+			{
+				return false;
+			}
+			if (if_range.front() == '"')
+			{
+				return if_range == info.etag;
+			}
+			return if_range == info.last_modified;
+		}
+
+		std::string const& boundary()
+		{
+			static const std::string str = []
+			{
+				std::random_device rd;
+				char hex[2 * sizeof(uint64_t) + 1];
+				integral_to_hex_str((static_cast<uint64_t>(rd()) << 32) | rd(), hex);
+				return std::string("timax_") + hex;
+			}();
+			return str;
+		}
+	}
+
+	namespace conditional
+	{
+		// If-None-Match使用弱比较, 忽略W/前缀
+		bool etag_matches(boost::string_ref list, boost::string_ref etag)
+		{
+			if (etag.starts_with("W/"))
+			{
+				etag.remove_prefix(2);
+			}
+
+			while (!list.empty())
+			{
+				auto pos = list.find(',');
+				auto item = list.substr(0, pos);
+				list = pos == boost::string_ref::npos ? boost::string_ref() : list.substr(pos + 1);
+
+				while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+				{
+					item.remove_prefix(1);
+				}
+				while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+				{
+					item.remove_suffix(1);
+				}
+
+				if (item == "*")
+				{
+					return true;
+				}
+				if (item.starts_with("W/"))
+				{
+					item.remove_prefix(2);
+				}
+				if (item == etag)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// last_modified为空时只看If-None-Match
+		bool not_modified(request const& req, boost::string_ref etag, boost::string_ref last_modified, time_t last_write_time)
+		{
+			if (req.method() != "GET" && req.method() != "HEAD")
+			{
+				return false;
+			}
+
+			// 有If-None-Match时忽略If-Modified-Since
+			auto if_none_match = req.get_headers("if-none-match", 13);
+			if (!if_none_match.empty())
+			{
+				for (auto const& list : if_none_match)
+				{
+					if (etag_matches(list, etag))
+					{
+						return true;
+					}
+				}
+				return false;
+			}
+
+			auto if_modified_since = req.get_header("if-modified-since", 17);
+			if (if_modified_since.empty() || last_modified.empty())
+			{
+				return false;
+			}
+
+			// 浏览器通常原样带回Last-Modified, 不必解析
+			if (if_modified_since == last_modified)
+			{
+				return true;
+			}
+
+			auto t = parse_http_date(if_modified_since.data(), if_modified_since.size());
+			return t != -1 && last_write_time <= t;
+		}
+
+		bool not_modified(request const& req, file_info const& info)
+		{
+			return not_modified(req, info.etag, info.last_modified, info.last_write_time);
+		}
+	}
+
+	bool reply::open_file(file_info_ptr info)
+	{
+		auto handle = info->handle();
+		if (!handle)
+		{
+			return false;
+		}
+
+		file_ = std::move(info);
+		file_handle_ = std::move(handle);
+		file_ranges_.clear();
+		file_range_index_ = 0;
+		file_offset_ = 0;
+		file_remain_ = 0;
+		file_left_ = 0;
+		file_trailer_.clear();
+		return true;
+	}
+
+	bool reply::response_whole_file(file_info_ptr info, std::string const& content_type)
+	{
+		if (!open_file(std::move(info)))
+		{
+			return false;
+		}
+
+		add_header("Content-Length", file_->content_length);
+		add_header("Last-Modified", file_->last_modified);
+		add_header("ETag", file_->etag);
+		add_header("Content-Type", content_type);
+		add_header("Accept-Ranges", "bytes");
+
+		if (file_->size == 0)
+		{
+			body_type_ = reply::string_body;
+			return true;
+		}
+
+		file_ranges_.emplace_back(file_range_t{ 0, file_->size, {} });
+		file_left_ = file_->size;
+		set_file_body();
+		return true;
+	}
+
 	bool reply::response_file(boost::filesystem::path path)
 	{
-		//TODO: 支持range
-		boost::system::error_code ec;
-		auto size = boost::filesystem::file_size(path, ec);
-		if (ec)
+		auto info = file_cache::instance().lookup(path);
+		if (!info)
 		{
 			return false;
 		}
-		add_header("Content-Length", boost::lexical_cast<std::string>(size));
 
-		auto last_time = boost::filesystem::last_write_time(path, ec);
-		if (ec)
+		auto const& content_type = info->content_type;
+		return response_whole_file(std::move(info), content_type);
+	}
+
+	bool reply::response_file(boost::filesystem::path path, request const& req)
+	{
+		auto original = file_cache::instance().lookup(path);
+		if (!original)
 		{
 			return false;
 		}
-		add_header("Last-Modified", http_date(last_time));
 
-		fs_.open(path.generic_string(), std::ios::binary | std::ios::in);
-		if (!fs_.is_open())
+		// 存在比原文件新的foo.js.br或foo.js.gz时按Accept-Encoding选择, Content-Type仍使用原文件的
+		struct variant_t
+		{
+			const char* coding;
+			const char* suffix;
+		};
+		static const variant_t variants[] = { { "br", ".br" }, { "gzip", ".gz" } };
+
+		auto info = original;
+		const char* content_encoding = nullptr;
+		bool has_variant = false;
+		auto accept_encoding = req.get_header("accept-encoding", 15);
+		int best_qvalue = 0;
+		for (auto const& v : variants)
+		{
+			auto variant = file_cache::instance().lookup(path.generic_string() + v.suffix);
+			if (!variant || variant->last_write_time < original->last_write_time)
+			{
+				continue;
+			}
+
+			has_variant = true;
+			auto qvalue = accept_encoding_qvalue(accept_encoding, v.coding);
+			if (qvalue > best_qvalue)
+			{
+				best_qvalue = qvalue;
+				info = std::move(variant);
+				content_encoding = v.coding;
+			}
+		}
+
+		if (has_variant)
+		{
+			add_header("Vary", "Accept-Encoding");
+		}
+
+		// 304只需要缓存的元数据, 不打开文件
+		if (conditional::not_modified(req, *info))
+		{
+			set_status(not_modified);
+			add_header("ETag", info->etag);
+			add_header("Last-Modified", info->last_modified);
+			body_type_ = reply::none;
+			return true;
+		}
+
+		// Range只按缓存的元数据判断, 416不打开文件
+		auto const& content_type = original->content_type;
+		auto range = req.get_header("range", 5);
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		auto result = byte_ranges::ignore;
+		if (!range.empty() && req.method() == "GET" && byte_ranges::if_range_matches(req.get_header("if-range", 8), *info))
+		{
+			result = byte_ranges::parse(range, info->size, ranges);
+		}
+
+		// 416的body是stock页面, 没有Content-Encoding
+		if (result == byte_ranges::unsatisfiable)
+		{
+			set_status(range_not_satisfiable);
+			add_header("Content-Range", "bytes */" + info->content_length);
+			add_header("Content-Type", "text/html");
+			response_text(stock_replies::to_string(range_not_satisfiable));
+			return true;
+		}
+
+		if (content_encoding)
+		{
+			add_header("Content-Encoding", content_encoding);
+		}
+
+		if (result == byte_ranges::ignore)
+		{
+			return response_whole_file(std::move(info), content_type);
+		}
+
+		if (!open_file(info))
 		{
 			return false;
 		}
 
-        add_header("Content-Type", mime_types::extension_to_type(path.extension().generic_string()));
+		auto const& size_str = file_->content_length;
+
+		set_status(partial_content);
+		add_header("Last-Modified", file_->last_modified);
+		add_header("ETag", file_->etag);
+		add_header("Accept-Ranges", "bytes");
+
+		if (ranges.size() == 1)
+		{
+			auto first = ranges[0].first, last = ranges[0].second;
+			add_header("Content-Type", content_type);
+			add_header("Content-Range", "bytes " + boost::lexical_cast<std::string>(first) + "-"
+				+ boost::lexical_cast<std::string>(last) + "/" + size_str);
+			add_header("Content-Length", boost::lexical_cast<std::string>(last - first + 1));
+			file_ranges_.emplace_back(file_range_t{ first, last - first + 1, {} });
+			file_left_ = last - first + 1;
+			set_file_body();
+			return true;
+		}
+
+		// multipart/byteranges, 每个part的头部预先生成以便计算Content-Length
+		auto const& boundary = byte_ranges::boundary();
+		uint64_t content_length = 0;
+		for (auto const& r : ranges)
+		{
+			auto part_header = "\r\n--" + boundary + "\r\nContent-Type: " + content_type
+				+ "\r\nContent-Range: bytes " + boost::lexical_cast<std::string>(r.first) + "-"
+				+ boost::lexical_cast<std::string>(r.second) + "/" + size_str + "\r\n\r\n";
+			content_length += part_header.size() + r.second - r.first + 1;
+			file_left_ += r.second - r.first + 1;
+			file_ranges_.emplace_back(file_range_t{ r.first, r.second - r.first + 1, std::move(part_header) });
+		}
+		file_trailer_ = "\r\n--" + boundary + "--\r\n";
+		content_length += file_trailer_.size();
+
+		add_header("Content-Type", "multipart/byteranges; boundary=" + boundary);
+		add_header("Content-Length", boost::lexical_cast<std::string>(content_length));
+		set_file_body();
+		return true;
+	}
+
+	void reply::set_file_body()
+	{
 		body_type_ = reply::file_body;
+		file_async_ = blocking_io_pool::instance().use_for(file_left_);
+	}
+
+	bool reply::prepare_file_body(boost::asio::io_service& ios, boost::shared_ptr<void> owner, boost::function<void()> handler)
+	{
+		if (body_type_ != reply::file_body || !file_async_ || file_ready_ != -1)
+		{
+			return true;
+		}
+
+		file_waiter_ = std::move(handler);
+		if (file_filling_)
+		{
+			return false;
+		}
+
+		// 上一块写完之前不会再读, 所以另一块此时一定空闲
+		file_filling_ = true;
+		auto index = file_next_;
+		file_next_ = 1 - file_next_;
+		blocking_io_pool::instance().post([this, &ios, owner, index]
+		{
+			fill_file_block(file_blocks_[index]);
+			ios.post([this, owner, index]
+			{
+				file_filling_ = false;
+				file_ready_ = index;
+				if (file_waiter_)
+				{
+					auto waiter = std::move(file_waiter_);
+					file_waiter_ = {};
+					waiter();
+				}
+			});
+		});
+		return false;
+	}
+
+	void reply::fill_file_block(file_block_t& block)
+	{
+		// 一次最多读1M, 多个小range合并到同一次写
+		auto& buffers = block.buffers;
+		auto& content = block.data;
+		buffers.clear();
+		block.finished = false;
+		content.resize(static_cast<std::size_t>(std::min<uint64_t>(file_left_, 1024 * 1024)));
+		std::size_t used = 0;
+		for (;;)
+		{
+			if (file_remain_ == 0)
+			{
+				if (file_range_index_ == file_ranges_.size())
+				{
+					if (!file_trailer_.empty())
+					{
+						buffers.emplace_back(boost::asio::buffer(file_trailer_));
+					}
+					block.finished = true;
+					return;
+				}
+
+				auto const& range = file_ranges_[file_range_index_++];
+				if (!range.part_header.empty())
+				{
+					buffers.emplace_back(boost::asio::buffer(range.part_header));
+				}
+				file_offset_ = range.offset;
+				file_remain_ = range.length;
+			}
+
+			if (used == content.size())
+			{
+				return;
+			}
+
+			auto size = static_cast<std::size_t>(std::min<uint64_t>(file_remain_, content.size() - used));
+			auto len = file_handle_->read_at(file_offset_, &content[used], size);
+			if (len <= 0)
+			{
+				// 头部发送后文件被截断, 客户端会收到不完整的body
+				block.finished = true;
+				return;
+			}
+
+			buffers.emplace_back(boost::asio::buffer(content.data() + used, static_cast<std::size_t>(len)));
+			used += len;
+			file_offset_ += len;
+			file_remain_ -= len;
+			file_left_ -= len;
+		}
+	}
+
+	void reply::negotiate_encoding(request const& req)
+	{
+		auto const& cfg = compression::config();
+		if (!cfg.enabled || status_ != ok || body_type_ == none || req.method() == "HEAD"
+			|| has_header("content-encoding", 16) || !compression::is_compressible(get_header("content-type", 12)))
+		{
+			return;
+		}
+
+		// 无论这次是否压缩, 缓存都要按Accept-Encoding区分
+		auto vary = std::find_if(headers_.begin(), headers_.end(), [](header_t const& hdr)
+		{
+			return iequal(hdr.name.data(), hdr.name.size(), "vary", 4);
+		});
+		if (vary == headers_.end())
+		{
+			add_header("Vary", "Accept-Encoding");
+		}
+		else if (!boost::ifind_first(vary->value, "accept-encoding"))
+		{
+			vary->value += ", Accept-Encoding";
+		}
+
+		auto accept_encoding = req.get_header("accept-encoding", 15);
+		// q值大的优先, 相同时选gzip
+		auto gzip_qvalue = accept_encoding_qvalue(accept_encoding, "gzip");
+		auto deflate_qvalue = accept_encoding_qvalue(accept_encoding, "deflate");
+		auto coding = compression::identity;
+		if (gzip_qvalue > 0 && gzip_qvalue >= deflate_qvalue)
+		{
+			coding = compression::gzip;
+		}
+		else if (deflate_qvalue > 0)
+		{
+			coding = compression::deflate;
+		}
+		else
+		{
+			return;
+		}
+
+		auto content_length = std::find_if(headers_.begin(), headers_.end(), [](header_t const& hdr)
+		{
+			return iequal(hdr.name.data(), hdr.name.size(), "content-length", 14);
+		});
+
+		switch (body_type_)
+		{
+		case reply::string_body:
+		{
+			if (content_.size() < cfg.min_size)
+			{
+				return;
+			}
+
+			auto compressed = compression::compress_cached(content_, coding);
+			if (!compressed || compressed->size() >= content_.size())
+			{
+				return;
+			}
+
+			content_ = *compressed;
+			if (content_length != headers_.end())
+			{
+				content_length->value = boost::lexical_cast<std::string>(content_.size());
+			}
+		}
+			break;
+		case reply::file_body:
+		{
+			// 压缩后长度未知, 需要chunked, 所以只处理HTTP/1.1的整文件回复
+			if (!file_ || file_->size < cfg.min_size || !req.is_http1_1() || file_ranges_.size() != 1)
+			{
+				return;
+			}
+
+			if (content_length != headers_.end())
+			{
+				headers_.erase(content_length);
+			}
+			headers_.erase(std::remove_if(headers_.begin(), headers_.end(), [](header_t const& hdr)
+			{
+				return iequal(hdr.name.data(), hdr.name.size(), "accept-ranges", 13);
+			}), headers_.end());
+
+			// 与nginx一样, 动态压缩后的表示只能给出弱ETag
+			for (auto& hdr : headers_)
+			{
+				if (iequal(hdr.name.data(), hdr.name.size(), "etag", 4) && hdr.value.compare(0, 2, "W/") != 0)
+				{
+					hdr.value.insert(0, "W/");
+				}
+			}
+
+			add_header("Transfer-Encoding", "chunked");
+			deflater_ = compression::deflate_stream::create(coding, cfg.level);
+		}
+			break;
+		case reply::chunked_body:
+			deflater_ = compression::deflate_stream::create(coding, cfg.level);
+			break;
+		default:
+			return;
+		}
+
+		add_header("Content-Encoding", compression::coding_name(coding));
+	}
+
+	bool reply::response_embedded(boost::string_ref path, request const& req)
+	{
+		auto asset = embedded_assets::find(path);
+		if (!asset)
+		{
+			return false;
+		}
+
+		// 打包时已生成gzip版本, 不走动态压缩
+		const void* data = asset->data;
+		auto size = asset->size;
+		auto content_length = asset->content_length;
+		auto etag = asset->etag;
+		bool gzipped = false;
+		if (asset->gzip_data)
+		{
+			add_header("Vary", "Accept-Encoding");
+			if (accept_encoding_qvalue(req.get_header("accept-encoding", 15), "gzip") > 0)
+			{
+				data = asset->gzip_data;
+				size = asset->gzip_size;
+				content_length = asset->gzip_content_length;
+				etag = asset->gzip_etag;
+				gzipped = true;
+			}
+		}
+
+		if (conditional::not_modified(req, etag, {}, 0))
+		{
+			set_status(not_modified);
+			add_header("ETag", etag);
+			body_type_ = reply::none;
+			return true;
+		}
+
+		add_header("Content-Length", content_length);
+		add_header("ETag", etag);
+		add_header("Content-Type", asset->content_type);
+		if (gzipped)
+		{
+			add_header("Content-Encoding", "gzip");
+		}
+
+		buffer_body_ = boost::asio::buffer(data, size);
+		body_type_ = size == 0 ? reply::string_body : reply::buffer_body;
 		return true;
 	}
 
@@ -6,14 +6,18 @@
 #include <boost/utility/string_ref.hpp>
 #include <boost/filesystem.hpp>
 
+#include <atomic>
 #include <string>
 #include <vector>
-#include <fstream>
 
 #include "picohttpparser.h"
+#include "file_cache.hpp"
+#include "compression.hpp"
 
 namespace timax
 {
+	class request;
+
 	using content_generator_t = boost::function<std::string(void)>;
 
 	class reply
@@ -32,6 +36,7 @@ namespace timax
 		using close_func_t = boost::function<void(void)>;
 		using is_closed_func_t = boost::function<bool(void)>;
 		using end_func_t = boost::function<void(void)>;
+		using migrate_func_t = boost::function<bool(boost::asio::io_service&)>;
 
 		class connection
 		{
@@ -40,10 +45,12 @@ namespace timax
 			//TODO:怎样简化???????
 			connection(reply& rep, write_func1_t write_func1, write_func2_t write_func2,
 				read_func_t read_func, read_func_t read_some_func, read_chunk_func_t read_chunk_func,
-				shutdown_func_t shutdown_func, close_func_t close_func, is_closed_func_t is_closed_func, end_func_t end_func)
-				:rep_(rep), write_func1_(std::move(write_func1)), write_func2_(std::move(write_func2)),
+				shutdown_func_t shutdown_func, close_func_t close_func, is_closed_func_t is_closed_func, end_func_t end_func,
+				migrate_func_t migrate_func, boost::asio::io_service& io_service)
+				:rep_(rep), io_service_(&io_service), write_func1_(std::move(write_func1)), write_func2_(std::move(write_func2)),
 				read_func_(std::move(read_func)), read_chunk_func_(std::move(read_chunk_func)), read_some_func_(std::move(read_some_func)),
-				shutdown_func_(std::move(shutdown_func)), close_func_(std::move(close_func)), is_closed_func_(std::move(is_closed_func)), end_func_(std::move(end_func))
+				shutdown_func_(std::move(shutdown_func)), close_func_(std::move(close_func)), is_closed_func_(std::move(is_closed_func)), end_func_(std::move(end_func)),
+				migrate_func_(std::move(migrate_func))
 			{}
 
 			void async_write(const void* data, std::size_t size, handler_ec_size_t handler) const
@@ -94,6 +101,30 @@ namespace timax
 			{
 				return rep_;
 			}
+
+			// 连接所在的io_service, 其他线程的操作可以post到这里. 迁移后会变
+			boost::asio::io_service& get_io_service()
+			{
+				return *io_service_;
+			}
+
+			// TLS和HTTP/2的连接不能迁移
+			bool can_migrate() const
+			{
+				return !migrate_func_.empty();
+			}
+
+			// 把socket换到另一个io_service上, 在当前io线程中且没有未完成的写时调用.
+			// 正在进行的读以operation_aborted结束(回调仍在原来的io_service上), 之后的操作都在to上
+			bool migrate(boost::asio::io_service& to)
+			{
+				if (!migrate_func_ || !migrate_func_(to))
+				{
+					return false;
+				}
+				io_service_ = &to;
+				return true;
+			}
 			// TODO: chunked write
 			~connection()
 			{
@@ -101,6 +132,7 @@ namespace timax
 			}
 		private:
 			reply& rep_;
+			std::atomic<boost::asio::io_service*> io_service_;
 			write_func1_t write_func1_;
 			write_func2_t write_func2_;
 			read_func_t read_func_;
@@ -110,6 +142,7 @@ namespace timax
 			close_func_t close_func_;
 			is_closed_func_t is_closed_func_;
 			end_func_t end_func_;
+			migrate_func_t migrate_func_;
 		};
 
 		using get_connection_func_t = boost::function<boost::shared_ptr<connection>()>;
@@ -121,6 +154,7 @@ namespace timax
 			created = 201,
 			accepted = 202,
 			no_content = 204,
+			partial_content = 206,
 			multiple_choices = 300,
 			moved_permanently = 301,
 			moved_temporarily = 302,
@@ -129,6 +163,7 @@ namespace timax
 			unauthorized = 401,
 			forbidden = 403,
 			not_found = 404,
+			range_not_satisfiable = 416,
 			internal_server_error = 500,
 			not_implemented = 501,
 			bad_gateway = 502,
@@ -142,8 +177,14 @@ namespace timax
 		};
 
 		bool to_buffers(std::vector<boost::asio::const_buffer>& buffers);
+		// 只取body的下一段, 返回true表示body已经结束. HTTP/2自己发送头部
+		bool body_to_buffers(std::vector<boost::asio::const_buffer>& buffers);
 		static reply stock_reply(status_type status);
 		void reset();
+		// reset之后还保留着容量, 空闲的长连接把它们也还回去
+		void release_memory();
+		// 头部和body缓冲区占用的字节数
+		std::size_t memory_usage() const;
 
 		status_type status()
 		{
@@ -178,8 +219,20 @@ namespace timax
 
 		void response_text(std::string body);
 		bool response_file(boost::filesystem::path path);
+		// 根据req中的条件请求头部返回304, 根据Range/If-Range头部返回206或416
+		bool response_file(boost::filesystem::path path, request const& req);
+		// 打包进程序的静态文件(tools/embed_assets), 没有path时返回false
+		bool response_embedded(boost::string_ref path, request const& req);
 		void response_by_generator(content_generator_t gen);
 
+		// 发送头部前调用, 按Accept-Encoding对可压缩的body启用gzip/deflate
+		void negotiate_encoding(request const& req);
+
+		// 大文件的body在blocking_io_pool中读取, 返回true表示下一块已在内存中, to_buffers不会阻塞.
+		// 否则开始读取(已在读取则不重复), 读完后在ios中调用handler, handler可以为空(预读).
+		// owner在读取期间保持存活
+		bool prepare_file_body(boost::asio::io_service& ios, boost::shared_ptr<void> owner, boost::function<void()> handler);
+
 		bool is_delay() const
 		{
 			return delay_;
@@ -206,12 +259,38 @@ namespace timax
 		{
 			none,
 			string_body,
+			// 不属于reply的内存, 如打包进程序的静态文件
+			buffer_body,
 			file_body,
 			chunked_body
 		};
 
 		body_type_t body_type() { return body_type_; }
+
+		// HTTP/2用DATA帧分段, 生成的和压缩后的body不加chunked编码
+		void set_chunked_framing(bool chunked) { chunked_framing_ = chunked; }
 	private:
+		struct file_range_t
+		{
+			uint64_t offset;
+			uint64_t length;
+			std::string part_header;
+		};
+
+		bool open_file(file_info_ptr info);
+		bool response_whole_file(file_info_ptr info, std::string const& content_type);
+		struct file_block_t
+		{
+			std::string data;
+			std::vector<boost::asio::const_buffer> buffers;
+			bool finished = false;
+		};
+
+		void set_file_body();
+		void fill_file_block(file_block_t& block);
+		void append_chunk(std::vector<boost::asio::const_buffer>& buffers, std::string const& data);
+		void append_chunked_end(std::vector<boost::asio::const_buffer>& buffers);
+
 		std::vector<header_t> headers_;
 		std::string content_;
 		status_type status_ = ok;
@@ -219,12 +298,31 @@ namespace timax
 		bool header_buffer_wroted_ = false;
 		body_type_t body_type_ = none;
 		
-		std::ifstream fs_;
+		file_info_ptr file_;
+		file_handle_ptr file_handle_;
+		std::vector<file_range_t> file_ranges_;
+		std::size_t file_range_index_ = 0;
+		uint64_t file_offset_ = 0;
+		uint64_t file_remain_ = 0;
+		uint64_t file_left_ = 0;
+		std::string file_trailer_;
+		// 双缓冲, 一块在写的同时读取另一块
+		file_block_t file_blocks_[2];
+		bool file_async_ = false;
+		bool file_filling_ = false;
+		int file_ready_ = -1;
+		int file_next_ = 0;
+		boost::function<void()> file_waiter_;
 		char chunked_len_buf_[20];
 		content_generator_t content_gen_;
+		boost::asio::const_buffer buffer_body_;
+
+		boost::shared_ptr<compression::deflate_stream> deflater_;
+		std::string compress_buf_;
 
 		get_connection_func_t get_connection_func_;
 
 		bool delay_ = false;
+		bool chunked_framing_ = true;
 	};
 }
@@ -1,6 +1,7 @@
 
 #include "request.hpp"
 #include "utils.h"
+#include "memory_report.hpp"
 
 #include <boost/lexical_cast/try_lexical_convert.hpp>
 #include <boost/algorithm/string/trim.hpp>
@@ -13,7 +14,7 @@ namespace timax
 	request::request()
 		:buffer_{static_cast<char*>(std::malloc(8192)), 0, 8192}
 	{
-
+		memory_report::request_buffer_changed(8192);
 	}
 
 	request::~request()
@@ -23,6 +24,7 @@ namespace timax
 			multipart_parser_free(multipart_parser_);
 		}
 		std::free(buffer_.buffer);
+		memory_report::request_buffer_changed(-static_cast<std::ptrdiff_t>(buffer_.max_size));
 	}
 
 	int request::parse_header(std::size_t last_len)
@@ -432,17 +434,38 @@ namespace timax
 	{
 		auto tmp = static_cast<char*>(std::realloc(buffer_.buffer, buffer_.max_size + size));
 
-		ptrdiff_t offset = tmp - buffer_.buffer;
-		fix_offset(method_, offset);
-		fix_offset(path_, offset);
-		for (auto it = headers_; it != headers_ + num_headers_; ++it)
+		// release_buffer֮ûָ򻺳ָ
+		if (buffer_.buffer)
 		{
-			fix_offset(it->name, offset);
-			fix_offset(it->value, offset);
+			ptrdiff_t offset = tmp - buffer_.buffer;
+			fix_offset(method_, offset);
+			fix_offset(path_, offset);
+			for (auto it = headers_; it != headers_ + num_headers_; ++it)
+			{
+				fix_offset(it->name, offset);
+				fix_offset(it->value, offset);
+			}
 		}
 
 		buffer_.buffer = tmp;
 		buffer_.max_size += size;
+		memory_report::request_buffer_changed(size);
+	}
+
+	void request::release_buffer()
+	{
+		memory_report::request_buffer_changed(-static_cast<std::ptrdiff_t>(buffer_.max_size));
+		std::free(buffer_.buffer);
+		buffer_.buffer = nullptr;
+		buffer_.size = 0;
+		buffer_.max_size = 0;
+		header_size_ = 0;
+		body_len_ = 0;
+		method_ = nullptr;
+		method_len_ = 0;
+		path_ = nullptr;
+		path_len_ = 0;
+		num_headers_ = 0;
 	}
 
 }
\ No newline at end of file
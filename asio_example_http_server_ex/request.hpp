@@ -130,6 +130,8 @@ namespace timax
 		}
 
 		void increase_buffer(std::size_t size);
+		// 空闲的长连接释放缓冲区, 下次读时increase_buffer重新分配
+		void release_buffer();
 
 
 		class form_parts_t
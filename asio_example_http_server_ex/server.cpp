@@ -1,13 +1,74 @@
 ﻿
 #include "server.hpp"
+#include "tls_session.hpp"
 
 #include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
 
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
 namespace timax
 {
+	namespace
+	{
+		// TLS 1.3的签名算法按这个顺序选, ECDSA在前: 签名更快, 证书链更小, 握手的第一个往返可以少占几个包
+		const char* const preferred_sigalgs[] =
+		{
+			"ECDSA+SHA256", "ECDSA+SHA384", "ECDSA+SHA512", "ed25519", "ed448",
+			"rsa_pss_rsae_sha256", "rsa_pss_rsae_sha384", "rsa_pss_rsae_sha512",
+			"rsa_pss_pss_sha256", "rsa_pss_pss_sha384", "rsa_pss_pss_sha512",
+			"RSA+SHA256", "RSA+SHA384", "RSA+SHA512"
+		};
+
+		// 列表中有一个名字OpenSSL不认识(如1.1.0没有ed448)就拒绝整个列表, 这时去掉不认识的再设置
+		void set_sigalgs(SSL_CTX* ctx)
+		{
+			std::string list;
+			for (auto name : preferred_sigalgs)
+			{
+				list += list.empty() ? "" : ":";
+				list += name;
+			}
+			if (SSL_CTX_set1_sigalgs_list(ctx, list.c_str()) == 1)
+			{
+				return;
+			}
+
+			list.clear();
+			std::string dropped;
+			for (auto name : preferred_sigalgs)
+			{
+				auto candidate = list.empty() ? std::string(name) : list + ':' + name;
+				if (SSL_CTX_set1_sigalgs_list(ctx, candidate.c_str()) == 1)
+				{
+					list = std::move(candidate);
+				}
+				else
+				{
+					dropped += ' ';
+					dropped += name;
+				}
+			}
+			ERR_clear_error();
+
+			// 最后一次设置可能失败了, 重新设置认识的部分
+			if (list.empty() || SSL_CTX_set1_sigalgs_list(ctx, list.c_str()) != 1)
+			{
+				std::cout << "server::listen: signature algorithm preference not applied" << std::endl;
+				return;
+			}
+			std::cout << "server::listen: unsupported signature algorithms:" << dropped << std::endl;
+		}
+	}
+
 	server::server(std::size_t io_service_pool_size)
 		: io_service_pool_(io_service_pool_size)
 	{
@@ -23,21 +84,49 @@ namespace timax
 
 	timax::server& server::listen(const std::string& address, const std::string& port, ssl_method_t ssl_method,
 		const std::string& private_key, const std::string& certificate_chain, bool is_file /*= true*/)
+	{
+		return listen(address, port, ssl_method, { certificate_t{ private_key, certificate_chain, is_file } });
+	}
+
+	timax::server& server::listen(const std::string& address, const std::string& port, ssl_method_t ssl_method,
+		std::vector<certificate_t> const& certificates)
 	{
 		auto ssl_ctx = boost::make_shared<boost::asio::ssl::context>(static_cast<boost::asio::ssl::context::method>(ssl_method));
-		if (is_file)
+		ssl_ctx->set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2
+			| boost::asio::ssl::context::no_sslv3 | boost::asio::ssl::context::no_compression);
+		auto native = ssl_ctx->native_handle();
+		if (ssl_method == tls)
 		{
-			ssl_ctx->use_private_key_file(private_key, boost::asio::ssl::context::pem);
-			ssl_ctx->use_certificate_chain_file(certificate_chain);
+			SSL_CTX_set_min_proto_version(native, TLS1_2_VERSION);
 		}
-		else
+
+		// OpenSSL每种密钥类型保存一张证书, 握手时按客户端支持的签名算法选择
+		for (auto const& cert : certificates)
 		{
-			ssl_ctx->use_private_key(boost::asio::buffer(private_key), boost::asio::ssl::context::pem);
-			ssl_ctx->use_certificate_chain(boost::asio::buffer(certificate_chain));
+			if (cert.is_file)
+			{
+				ssl_ctx->use_private_key_file(cert.private_key, boost::asio::ssl::context::pem);
+				ssl_ctx->use_certificate_chain_file(cert.certificate_chain);
+			}
+			else
+			{
+				ssl_ctx->use_private_key(boost::asio::buffer(cert.private_key), boost::asio::ssl::context::pem);
+				ssl_ctx->use_certificate_chain(boost::asio::buffer(cert.certificate_chain));
+			}
+		}
+
+		// 按我们的顺序选签名算法(TLS 1.3)和密码套件(TLS 1.2)
+		SSL_CTX_set_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE);
+		set_sigalgs(native);
+
+		if (memory_report::idle_release())
+		{
+			SSL_CTX_set_mode(native, SSL_MODE_RELEASE_BUFFERS);
 		}
 
-		//HTTP2???
-		//configure_tls_context_easy(ec, tls);
+		tls::enable_resumption(*ssl_ctx);
+		http2::enable_alpn(*ssl_ctx);
+
 		auto acceprot = boost::make_shared<boost::asio::ip::tcp::acceptor>(io_service_pool_.get_io_service());
 		do_listen(acceprot, address, port);
 		start_accept(acceprot, ssl_ctx);
@@ -72,32 +161,57 @@ namespace timax
 	void server::start_accept(boost::shared_ptr<boost::asio::ip::tcp::acceptor> const& acceptor,
 		boost::shared_ptr<boost::asio::ssl::context> const& ssl_ctx)
 	{
+		// 握手槽用完时暂停accept, 新连接留在内核的backlog里, 有握手完成时再继续.
+		// 暂停期间acceptor上没有操作, 可以在完成握手的线程中继续
+		auto& pool = handshake_pool::instance();
+		if (pool.enabled() && !pool.acquire([this, acceptor, ssl_ctx] { start_accept(acceptor, ssl_ctx); }))
+		{
+			return;
+		}
+
 		auto new_conn = boost::make_shared<connection<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>>(
 			io_service_pool_.get_io_service(), request_handler_, *ssl_ctx);
 		acceptor->async_accept(new_conn->socket().lowest_layer(), [this, new_conn, acceptor, ssl_ctx](const boost::system::error_code& e)
 		{
+			auto& pool = handshake_pool::instance();
 			if (!e)
 			{
 				new_conn->socket().lowest_layer().set_option(boost::asio::ip::tcp::no_delay(true));
-				new_conn->reset_timer();
-				new_conn->socket().async_handshake(boost::asio::ssl::stream_base::server,
-					[new_conn](const boost::system::error_code &e)
+				auto handshake_handler = [new_conn](const boost::system::error_code &e)
 				{
+					if (handshake_pool::instance().enabled())
+					{
+						handshake_pool::instance().release();
+					}
 					if (e)
 					{
 						return;
 					}
-					//HTTP2???
-// 					if (!tls_h2_negotiated(new_conn->socket()))
-// 					{
-// 						return;
-// 					}
+					if (http2::negotiated(new_conn->socket().native_handle()))
+					{
+						new_conn->start_http2(nullptr, 0);
+						return;
+					}
 					new_conn->start();
-				});
+				};
+
+				if (pool.enabled())
+				{
+					new_conn->handshake_on(pool.get_io_service(), handshake_handler);
+				}
+				else
+				{
+					new_conn->reset_timer();
+					new_conn->socket().async_handshake(boost::asio::ssl::stream_base::server, handshake_handler);
+				}
 			}
 			else
 			{
 				std::cout << "server::handle_accept: " << e.message() << std::endl;
+				if (pool.enabled())
+				{
+					pool.release();
+				}
 			}
 
 			start_accept(acceptor, ssl_ctx);
@@ -107,12 +221,19 @@ namespace timax
 	void server::do_listen(boost::shared_ptr<boost::asio::ip::tcp::acceptor> const& acceptor,
 		const std::string& address, const std::string& port)
 	{
-		boost::asio::ip::tcp::resolver resolver(acceptor->get_io_service());
+		boost::asio::ip::tcp::resolver resolver(acceptor->get_executor());
 		boost::asio::ip::tcp::resolver::query query(address, port);
 		boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
 		acceptor->open(endpoint.protocol());
 		acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
 		acceptor->bind(endpoint);
+#if defined(__linux__) && defined(TCP_FASTOPEN)
+		if (fast_open_ > 0 && setsockopt(acceptor->native_handle(), IPPROTO_TCP, TCP_FASTOPEN, &fast_open_, sizeof(fast_open_)) != 0)
+		{
+			// 内核不支持或net.ipv4.tcp_fastopen没有开启服务端, 照常监听
+			std::cout << "server::do_listen: TCP_FASTOPEN: " << std::strerror(errno) << std::endl;
+		}
+#endif
 		acceptor->listen();
 	}
 
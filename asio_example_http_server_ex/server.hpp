@@ -3,6 +3,7 @@
 
 #include "io_service_pool.hpp"
 #include "connection.hpp"
+#include "handshake_pool.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
@@ -23,17 +24,32 @@ namespace timax
 
 		enum ssl_method_t
 		{
+			// sslv2和sslv3不安全, 新版OpenSSL已不支持, 只为兼容保留
 			sslv2 = boost::asio::ssl::context::sslv2_server,
 			sslv3 = boost::asio::ssl::context::sslv3_server,
 			tlsv1 = boost::asio::ssl::context::tlsv1_server,
 			tlsv11 = boost::asio::ssl::context::tlsv11_server,
 			tlsv12 = boost::asio::ssl::context::tlsv12_server,
+			tlsv13 = boost::asio::ssl::context::tlsv13_server,
+			// 协商TLS 1.2或1.3. TLS 1.3的完整握手比1.2少一个往返
+			tls = boost::asio::ssl::context::tls_server,
 			sslv23 = boost::asio::ssl::context::sslv23_server
 		};
 
+		struct certificate_t
+		{
+			// is_file为true时是证书路径, 否则是证书内容
+			std::string private_key;
+			std::string certificate_chain;
+			bool is_file;
+		};
+
 		server& listen(const std::string& address, const std::string& port);
 		server& listen(const std::string& address, const std::string& port, ssl_method_t ssl_method,
 			const std::string& private_key, const std::string& certificate_chain, bool is_file = true);
+		// 多张不同密钥类型的证书(如ECDSA和RSA各一张), 客户端支持ECDSA时优先用ECDSA
+		server& listen(const std::string& address, const std::string& port, ssl_method_t ssl_method,
+			std::vector<certificate_t> const& certificates);
 
 		void run();
 
@@ -42,6 +58,44 @@ namespace timax
 			request_handler_ = std::move(handler);
 		}
 
+		// 每隔interval_ms毫秒把空闲的websocket连接从连接多的io线程迁到少的, 0不迁移
+		server& rebalance(std::size_t interval_ms)
+		{
+			io_service_pool_.enable_rebalance(interval_ms);
+			return *this;
+		}
+
+		// TLS握手在threads个单独的线程中进行, 突发的新连接不占用处理请求的io线程, 0不使用.
+		// 最多max_in_flight个连接在握手(0不限制), 超过时暂停accept. 要在listen之前调用
+		server& handshake_threads(std::size_t threads, std::size_t max_in_flight = 256)
+		{
+			handshake_pool::instance().configure(threads, max_in_flight);
+			return *this;
+		}
+
+		// 监听socket开启TCP Fast Open, queue_length为等待中的TFO连接数, 0不开启. 要在listen之前调用.
+		// 重连的客户端在SYN中带上ClientHello或请求, 省一个往返. SYN中的数据可能被重放,
+		// 在TLS监听上只是ClientHello, 明文监听上只适合幂等的请求
+		server& fast_open(int queue_length)
+		{
+			fast_open_ = queue_length;
+			return *this;
+		}
+
+		// 空闲内存模式: 长连接等下一个请求时释放请求和回复的缓冲区, TLS连接同时释放OpenSSL的读写记录缓冲区
+		// (SSL_MODE_RELEASE_BUFFERS, 每个连接约34K). 大量空闲的TLS连接时开启. 要在listen之前调用
+		server& idle_memory(bool enable)
+		{
+			memory_report::set_idle_release(enable);
+			return *this;
+		}
+
+		// 连接数和缓冲区占用的汇总
+		std::string memory_summary() const
+		{
+			return memory_report::summary();
+		}
+
 		void stop();
 
 	private:
@@ -54,6 +108,8 @@ namespace timax
 
 		io_service_pool io_service_pool_;
 		request_handler_t request_handler_;
+
+		int fast_open_ = 0;
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "timing_wheel.hpp"
+
+#include <boost/make_shared.hpp>
+
+#include <chrono>
+
+namespace timax
+{
+	namespace
+	{
+		const uint64_t tick_ms = 100;
+		// 一圈约102秒, 更长的定时器记圈数
+		const std::size_t slot_count = 1024;
+	}
+
+	boost::asio::io_service::id timing_wheel::id;
+
+	timing_wheel::timing_wheel(boost::asio::io_service& ios)
+		: boost::asio::io_service::service(ios), timer_(ios), wheel_(slot_count)
+	{
+	}
+
+	timing_wheel::handle_t timing_wheel::schedule(uint64_t delay_ms, boost::function<void()> handler)
+	{
+		auto ticks = (delay_ms + tick_ms - 1) / tick_ms;
+		if (ticks == 0)
+		{
+			ticks = 1;
+		}
+
+		auto entry = boost::make_shared<entry_t>();
+		entry->handler = std::move(handler);
+		entry->rounds = static_cast<std::size_t>((ticks - 1) / slot_count);
+		entry->cancelled = false;
+		wheel_[(current_ + ticks) % slot_count].push_back(entry);
+		++size_;
+
+		if (!running_)
+		{
+			start_timer();
+		}
+		return entry;
+	}
+
+	void timing_wheel::cancel(handle_t& handle)
+	{
+		if (handle)
+		{
+			// 在轮上的位置不找了, 转到时丢弃
+			handle->cancelled = true;
+			handle->handler.clear();
+			handle.reset();
+		}
+	}
+
+	uint64_t timing_wheel::now()
+	{
+		using namespace std::chrono;
+		return static_cast<uint64_t>(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+	}
+
+	void timing_wheel::shutdown_service()
+	{
+		boost::system::error_code ignored_ec;
+		timer_.cancel(ignored_ec);
+		for (auto& slot : wheel_)
+		{
+			slot.clear();
+		}
+		size_ = 0;
+	}
+
+	void timing_wheel::start_timer()
+	{
+		running_ = true;
+		timer_.expires_from_now(boost::posix_time::milliseconds(tick_ms));
+		timer_.async_wait([this](boost::system::error_code const& ec)
+		{
+			if (ec)
+			{
+				running_ = false;
+				return;
+			}
+			on_tick();
+		});
+	}
+
+	void timing_wheel::on_tick()
+	{
+		current_ = (current_ + 1) % slot_count;
+
+		// 先从槽里取出到期的, handler中可能再schedule
+		std::vector<handle_t> due;
+		auto& slot = wheel_[current_];
+		std::size_t kept = 0;
+		for (auto& entry : slot)
+		{
+			if (entry->cancelled)
+			{
+				continue;
+			}
+			if (entry->rounds > 0)
+			{
+				--entry->rounds;
+				slot[kept++] = std::move(entry);
+			}
+			else
+			{
+				due.push_back(std::move(entry));
+			}
+		}
+		size_ -= slot.size() - kept;
+		slot.resize(kept);
+
+		for (auto& entry : due)
+		{
+			// 前面的handler可能取消了后面的
+			if (!entry->cancelled)
+			{
+				auto handler = std::move(entry->handler);
+				entry->cancelled = true;
+				handler();
+			}
+		}
+
+		if (size_ > 0)
+		{
+			start_timer();
+		}
+		else
+		{
+			running_ = false;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace timax
+{
+	// 每个io_service一个的时间轮, 精度100ms, 所有连接的超时共用一个deadline_timer.
+	// 只有轮上有定时器时deadline_timer才在走. schedule和cancel只能在这个io_service的线程中调用
+	class timing_wheel
+		: public boost::asio::io_service::service
+	{
+	public:
+		static boost::asio::io_service::id id;
+
+		struct entry_t
+		{
+			boost::function<void()> handler;
+			// 还要转几圈
+			std::size_t rounds;
+			bool cancelled;
+		};
+		using handle_t = boost::shared_ptr<entry_t>;
+
+		explicit timing_wheel(boost::asio::io_service& ios);
+
+		static timing_wheel& get(boost::asio::io_service& ios)
+		{
+			return boost::asio::use_service<timing_wheel>(ios);
+		}
+
+		// delay_ms毫秒后在io_service的线程中调用handler, 向上取整到100ms
+		handle_t schedule(uint64_t delay_ms, boost::function<void()> handler);
+
+		// handle可以为空, 已经触发过的忽略
+		static void cancel(handle_t& handle);
+
+		// 单调时钟, 毫秒
+		static uint64_t now();
+
+	private:
+		void shutdown_service() override;
+		void start_timer();
+		void on_tick();
+
+		boost::asio::deadline_timer timer_;
+		std::vector<std::vector<handle_t>> wheel_;
+		std::size_t current_ = 0;
+		std::size_t size_ = 0;
+		bool running_ = false;
+	};
+}
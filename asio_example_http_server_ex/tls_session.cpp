@@ -0,0 +1,419 @@
+#include "tls_session.hpp"
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace timax
+{
+	namespace tls
+	{
+		namespace
+		{
+			int64_t now_seconds()
+			{
+				using namespace std::chrono;
+				return duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+			}
+
+			// server side cache of serialized sessions, sharded by session id so handshakes on
+			// different io_service threads rarely contend
+			class session_cache
+			{
+			public:
+				void configure(std::size_t size, std::size_t shards, int timeout)
+				{
+					shards_ = std::vector<shard_t>(shards == 0 ? 1 : shards);
+					per_shard_ = (size + shards_.size() - 1) / shards_.size();
+					timeout_ = timeout;
+				}
+
+				void put(const unsigned char* id, unsigned int id_length, std::string der)
+				{
+					std::string key(reinterpret_cast<const char*>(id), id_length);
+					auto& shard = shard_for(key);
+					boost::lock_guard<boost::mutex> lock(shard.mutex);
+					auto& entry = shard.sessions[key];
+					if (entry.der.empty())
+					{
+						shard.order.push_back(key);
+					}
+					entry.der = std::move(der);
+					entry.expires = now_seconds() + timeout_;
+
+					// oldest first, entries already removed are skipped
+					while (shard.sessions.size() > per_shard_ && !shard.order.empty())
+					{
+						shard.sessions.erase(shard.order.front());
+						shard.order.pop_front();
+					}
+					if (shard.order.size() > 2 * per_shard_ + 16)
+					{
+						compact(shard);
+					}
+				}
+
+				bool get(const unsigned char* id, int id_length, std::string& der)
+				{
+					std::string key(reinterpret_cast<const char*>(id), static_cast<std::size_t>(id_length));
+					auto& shard = shard_for(key);
+					boost::lock_guard<boost::mutex> lock(shard.mutex);
+					auto it = shard.sessions.find(key);
+					if (it == shard.sessions.end())
+					{
+						return false;
+					}
+					if (it->second.expires <= now_seconds())
+					{
+						shard.sessions.erase(it);
+						return false;
+					}
+					der = it->second.der;
+					return true;
+				}
+
+				void remove(const unsigned char* id, unsigned int id_length)
+				{
+					std::string key(reinterpret_cast<const char*>(id), id_length);
+					auto& shard = shard_for(key);
+					boost::lock_guard<boost::mutex> lock(shard.mutex);
+					shard.sessions.erase(key);
+				}
+
+			private:
+				struct entry_t
+				{
+					std::string der;
+					int64_t expires;
+				};
+
+				struct shard_t
+				{
+					boost::mutex mutex;
+					std::unordered_map<std::string, entry_t> sessions;
+					std::deque<std::string> order;
+				};
+
+				shard_t& shard_for(std::string const& key)
+				{
+					return shards_[std::hash<std::string>()(key) % shards_.size()];
+				}
+
+				// drop ids of removed sessions from the eviction order
+				static void compact(shard_t& shard)
+				{
+					std::deque<std::string> order;
+					for (auto& key : shard.order)
+					{
+						auto it = shard.sessions.find(key);
+						if (it != shard.sessions.end() && !it->second.der.empty())
+						{
+							order.push_back(std::move(key));
+						}
+					}
+					shard.order.swap(order);
+				}
+
+				std::vector<shard_t> shards_;
+				std::size_t per_shard_ = 0;
+				int timeout_ = 0;
+			};
+
+			struct ticket_key_t
+			{
+				unsigned char name[16];
+				unsigned char hmac[32];
+				unsigned char aes[32];
+			};
+
+			// keys[0] encrypts, all of them decrypt. Rotation happens lazily on the first
+			// handshake after the interval has passed
+			class ticket_keys
+			{
+			public:
+				void configure(std::string file, int rotation, int lifetime)
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					file_ = std::move(file);
+					rotation_ = rotation > 0 ? rotation : 3600;
+					// a ticket issued just before a rotation must stay decryptable for its lifetime
+					max_keys_ = static_cast<std::size_t>(lifetime / rotation_) + 2;
+					keys_.clear();
+					rotate();
+				}
+
+				bool encrypt_key(ticket_key_t& key)
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					rotate_if_due();
+					if (keys_.empty())
+					{
+						return false;
+					}
+					key = keys_.front();
+					return true;
+				}
+
+				// 0 unknown key, 1 current key, 2 old key and the ticket should be renewed
+				int decrypt_key(const unsigned char* name, ticket_key_t& key)
+				{
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					rotate_if_due();
+					for (std::size_t i = 0; i < keys_.size(); ++i)
+					{
+						if (std::memcmp(keys_[i].name, name, sizeof(keys_[i].name)) == 0)
+						{
+							key = keys_[i];
+							return i == 0 ? 1 : 2;
+						}
+					}
+					return 0;
+				}
+
+			private:
+				void rotate_if_due()
+				{
+					if (now_seconds() >= next_rotation_)
+					{
+						rotate();
+					}
+				}
+
+				void rotate()
+				{
+					next_rotation_ = now_seconds() + rotation_;
+					if (!file_.empty())
+					{
+						// keep the old keys when the file is missing or being rewritten
+						std::vector<ticket_key_t> loaded;
+						if (load(file_, loaded))
+						{
+							keys_.swap(loaded);
+						}
+						return;
+					}
+
+					ticket_key_t key;
+					if (RAND_bytes(reinterpret_cast<unsigned char*>(&key), sizeof(key)) != 1)
+					{
+						return;
+					}
+					keys_.insert(keys_.begin(), key);
+					if (keys_.size() > max_keys_)
+					{
+						keys_.resize(max_keys_);
+					}
+				}
+
+				static bool load(std::string const& file, std::vector<ticket_key_t>& keys)
+				{
+					std::ifstream in(file, std::ios::binary);
+					std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+					if (data.empty() || data.size() % sizeof(ticket_key_t) != 0)
+					{
+						return false;
+					}
+
+					keys.resize(data.size() / sizeof(ticket_key_t));
+					std::memcpy(keys.data(), data.data(), data.size());
+					return true;
+				}
+
+				boost::mutex mutex_;
+				std::string file_;
+				int rotation_ = 3600;
+				std::size_t max_keys_ = 3;
+				int64_t next_rotation_ = 0;
+				std::vector<ticket_key_t> keys_;
+			};
+
+			session_cache& cache()
+			{
+				static session_cache c;
+				return c;
+			}
+
+			ticket_keys& keys()
+			{
+				static ticket_keys k;
+				return k;
+			}
+
+			int new_session(SSL*, SSL_SESSION* session)
+			{
+				int length = i2d_SSL_SESSION(session, nullptr);
+				if (length <= 0)
+				{
+					return 0;
+				}
+
+				std::string der(static_cast<std::size_t>(length), '\0');
+				auto p = reinterpret_cast<unsigned char*>(&der[0]);
+				i2d_SSL_SESSION(session, &p);
+
+				unsigned int id_length = 0;
+				auto id = SSL_SESSION_get_id(session, &id_length);
+				cache().put(id, id_length, std::move(der));
+				// the cache keeps its own copy, OpenSSL keeps ownership of session
+				return 0;
+			}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			SSL_SESSION* get_session(SSL*, const unsigned char* id, int id_length, int* copy)
+#else
+			SSL_SESSION* get_session(SSL*, unsigned char* id, int id_length, int* copy)
+#endif
+			{
+				*copy = 0;
+				std::string der;
+				if (!cache().get(id, id_length, der))
+				{
+					return nullptr;
+				}
+
+				auto p = reinterpret_cast<const unsigned char*>(der.data());
+				return d2i_SSL_SESSION(nullptr, &p, static_cast<long>(der.size()));
+			}
+
+			void remove_session(SSL_CTX*, SSL_SESSION* session)
+			{
+				unsigned int id_length = 0;
+				auto id = SSL_SESSION_get_id(session, &id_length);
+				cache().remove(id, id_length);
+			}
+
+			// tickets are AES-256-CBC encrypted and HMAC-SHA256 authenticated, as OpenSSL does by default
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			int ticket_key_callback(SSL*, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int enc)
+#else
+			int ticket_key_callback(SSL*, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int enc)
+#endif
+			{
+				ticket_key_t key;
+				int result = 1;
+				if (enc)
+				{
+					if (!keys().encrypt_key(key) || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+					{
+						return -1;
+					}
+					std::memcpy(name, key.name, sizeof(key.name));
+					if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) != 1)
+					{
+						return -1;
+					}
+				}
+				else
+				{
+					// unknown keys mean a full handshake and a fresh ticket
+					result = keys().decrypt_key(name, key);
+					if (result == 0)
+					{
+						return 0;
+					}
+					if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) != 1)
+					{
+						return -1;
+					}
+				}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+				char digest[] = "SHA256";
+				OSSL_PARAM params[] =
+				{
+					OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+					OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+					OSSL_PARAM_construct_end()
+				};
+				if (EVP_MAC_CTX_set_params(mac, params) != 1)
+				{
+					return -1;
+				}
+#else
+				if (HMAC_Init_ex(mac, key.hmac, sizeof(key.hmac), EVP_sha256(), nullptr) != 1)
+				{
+					return -1;
+				}
+#endif
+				OPENSSL_cleanse(&key, sizeof(key));
+				return result;
+			}
+		}
+
+		config_t& config()
+		{
+			static config_t cfg;
+			return cfg;
+		}
+
+		void enable_resumption(boost::asio::ssl::context& ctx)
+		{
+			auto const& cfg = config();
+			auto native = ctx.native_handle();
+			SSL_CTX_set_timeout(native, cfg.session_timeout);
+
+			// all listeners share the cache and keys, so the session id context must match too
+			static const unsigned char sid_context[] = "timax";
+			SSL_CTX_set_session_id_context(native, sid_context, sizeof(sid_context) - 1);
+
+			static boost::once_flag once;
+			boost::call_once(once, [&cfg]
+			{
+				cache().configure(cfg.cache_size, cfg.cache_shards, cfg.session_timeout);
+				if (cfg.tickets)
+				{
+					keys().configure(cfg.ticket_key_file, cfg.ticket_rotation, cfg.session_timeout);
+				}
+			});
+
+			// clients often close without close_notify, OpenSSL 3 treats that as a fatal error and
+			// drops the session from the cache
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+			SSL_CTX_set_options(native, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+			if (cfg.cache_size != 0)
+			{
+				SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+				SSL_CTX_sess_set_new_cb(native, new_session);
+				SSL_CTX_sess_set_get_cb(native, get_session);
+				SSL_CTX_sess_set_remove_cb(native, remove_session);
+			}
+			else
+			{
+				SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_OFF);
+			}
+
+			if (cfg.tickets)
+			{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+				SSL_CTX_set_tlsext_ticket_key_evp_cb(native, ticket_key_callback);
+#else
+				SSL_CTX_set_tlsext_ticket_key_cb(native, ticket_key_callback);
+#endif
+			}
+			else
+			{
+				SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+			}
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+
+#include <cstddef>
+#include <string>
+
+namespace timax
+{
+	namespace tls
+	{
+		struct config_t
+		{
+			// sessions kept in the server side cache for TLS 1.2 session ids and TLS 1.3 stateful
+			// resumption, 0 disables the cache
+			std::size_t cache_size = 20480;
+			// the cache is split into this many independently locked shards
+			std::size_t cache_shards = 16;
+			// lifetime of cached sessions and tickets, in seconds
+			int session_timeout = 3600;
+
+			// stateless session tickets
+			bool tickets = true;
+			// 80 byte keys as used by nginx (16 byte name, 32 byte HMAC secret, 32 byte AES key),
+			// one or more concatenated, the first encrypts new tickets. Processes reading the same file
+			// resume each other's sessions. Empty to generate random keys in this process
+			std::string ticket_key_file;
+			// seconds between key rotations: a new random key, or a re-read of ticket_key_file
+			int ticket_rotation = 3600;
+		};
+
+		// set before the server starts
+		config_t& config();
+
+		// install the shared session cache and ticket keys on ctx, called for every TLS listener
+		void enable_resumption(boost::asio::ssl::context& ctx);
+	}
+}
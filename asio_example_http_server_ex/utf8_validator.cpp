@@ -0,0 +1,387 @@
+#include "utf8_validator.hpp"
+#include "cpu_features.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace timax
+{
+	namespace
+	{
+		using kernel_t = bool(*)(const unsigned char *, std::size_t);
+
+		// 短于这个长度时用逐字节的实现
+		const std::size_t min_simd_length = 32;
+
+		bool validate_scalar(const unsigned char *s, std::size_t length)
+		{
+			for (const unsigned char *e = s + length; s != e; )
+			{
+				uint32_t word = 0x80;
+				if (s + 4 <= e)
+				{
+					std::memcpy(&word, s, 4);
+				}
+
+				if ((word & 0x80808080) == 0)
+				{
+					s += 4;
+				}
+				else
+				{
+					while (!(*s & 0x80))
+					{
+						if (++s == e)
+						{
+							return true;
+						}
+					}
+
+					if ((s[0] & 0x60) == 0x40)
+					{
+						if (s + 1 >= e || (s[1] & 0xc0) != 0x80 || (s[0] & 0xfe) == 0xc0)
+						{
+							return false;
+						}
+						s += 2;
+					}
+					else if ((s[0] & 0xf0) == 0xe0)
+					{
+						if (s + 2 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+							(s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) || (s[0] == 0xed && (s[1] & 0xe0) == 0xa0))
+						{
+							return false;
+						}
+						s += 3;
+					}
+					else if ((s[0] & 0xf8) == 0xf0)
+					{
+						if (s + 3 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80 ||
+							(s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) || (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4)
+						{
+							return false;
+						}
+						s += 4;
+					}
+					else
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+#ifdef TIMAX_X86_SIMD
+		// 查表法(Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"):
+		// 用前一字节的高/低4位和当前字节的高4位各查一次表, 三个结果相与后非0即为错误.
+		// 3/4字节码点的第3, 4字节另外用饱和减法检查
+		enum : unsigned char
+		{
+			TOO_SHORT = 1 << 0,		// 11______ 0_______ / 11______ 11______
+			TOO_LONG = 1 << 1,		// 0_______ 10______
+			OVERLONG_3 = 1 << 2,	// 11100000 100_____
+			TOO_LARGE = 1 << 3,		// 11110100 1001____ / 11110100 101_____ / 11110101.. 10______
+			SURROGATE = 1 << 4,		// 11101101 101_____
+			OVERLONG_2 = 1 << 5,	// 1100000_ 10______
+			TOO_LARGE_1000 = 1 << 6,	// 11110101.. 1000____
+			OVERLONG_4 = 1 << 6,	// 11110000 1000____
+			TWO_CONTS = 1 << 7,		// 10______ 10______
+			CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+		};
+
+		alignas(16) const unsigned char byte_1_high[16] =
+		{
+			TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+			TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+			TOO_SHORT | OVERLONG_2,
+			TOO_SHORT,
+			TOO_SHORT | OVERLONG_3 | SURROGATE,
+			TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+		};
+
+		alignas(16) const unsigned char byte_1_low[16] =
+		{
+			CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+			CARRY | OVERLONG_2,
+			CARRY,
+			CARRY,
+			CARRY | TOO_LARGE,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000
+		};
+
+		alignas(16) const unsigned char byte_2_high[16] =
+		{
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+		};
+
+		// 块的最后3个字节中, 大于这些值的是还没结束的码点的首字节
+		alignas(16) const unsigned char incomplete_max[16] =
+		{
+			0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+		};
+
+		struct sse_state_t
+		{
+			__m128i prev_input;
+			__m128i prev_incomplete;
+			__m128i error;
+		};
+
+		TIMAX_TARGET_SSE41 inline __m128i high_nibbles(__m128i v)
+		{
+			return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+		}
+
+		TIMAX_TARGET_SSE41 inline void check_block(__m128i input, sse_state_t& st)
+		{
+			if (_mm_movemask_epi8(input) == 0)
+			{
+				// 纯ASCII, 只要上一块没有停在码点中间
+				st.error = _mm_or_si128(st.error, st.prev_incomplete);
+			}
+			else
+			{
+				auto prev1 = _mm_alignr_epi8(input, st.prev_input, 15);
+				auto b1h = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_high)), high_nibbles(prev1));
+				auto b1l = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_low)), _mm_and_si128(prev1, _mm_set1_epi8(0x0f)));
+				auto b2h = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_2_high)), high_nibbles(input));
+				auto special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+				auto prev2 = _mm_alignr_epi8(input, st.prev_input, 14);
+				auto prev3 = _mm_alignr_epi8(input, st.prev_input, 13);
+				auto third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+				auto fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+				auto must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+
+				st.error = _mm_or_si128(st.error, _mm_xor_si128(must23, special));
+				st.prev_incomplete = _mm_subs_epu8(input, _mm_load_si128(reinterpret_cast<const __m128i *>(incomplete_max)));
+			}
+			st.prev_input = input;
+		}
+
+		TIMAX_TARGET_SSE41 bool validate_sse41(const unsigned char *s, std::size_t length)
+		{
+			sse_state_t st = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+			std::size_t i = 0;
+			for (; i + 16 <= length; i += 16)
+			{
+				check_block(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)), st);
+			}
+
+			// 剩下的字节补0, 补的0也能查出停在码点中间
+			if (i < length)
+			{
+				alignas(16) unsigned char tail[16] = {};
+				std::memcpy(tail, s + i, length - i);
+				check_block(_mm_load_si128(reinterpret_cast<const __m128i *>(tail)), st);
+			}
+
+			auto error = _mm_or_si128(st.error, st.prev_incomplete);
+			return _mm_testz_si128(error, error) != 0;
+		}
+
+		struct avx_state_t
+		{
+			__m256i prev_input;
+			__m256i prev_incomplete;
+			__m256i error;
+		};
+
+		TIMAX_TARGET_AVX2 inline __m256i broadcast_table(const unsigned char *table)
+		{
+			return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(table)));
+		}
+
+		// 两个128位lane之间的alignr: 结果为input向高位移n字节, 低位由prev_input的高n字节补上
+		template<int N>
+		TIMAX_TARGET_AVX2 inline __m256i prev_bytes(__m256i input, __m256i prev_input)
+		{
+			return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - N);
+		}
+
+		TIMAX_TARGET_AVX2 inline void check_block(__m256i input, avx_state_t& st)
+		{
+			if (_mm256_movemask_epi8(input) == 0)
+			{
+				st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+			}
+			else
+			{
+				auto low_mask = _mm256_set1_epi8(0x0f);
+				auto prev1 = prev_bytes<1>(input, st.prev_input);
+				auto b1h = _mm256_shuffle_epi8(broadcast_table(byte_1_high), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_mask));
+				auto b1l = _mm256_shuffle_epi8(broadcast_table(byte_1_low), _mm256_and_si256(prev1, low_mask));
+				auto b2h = _mm256_shuffle_epi8(broadcast_table(byte_2_high), _mm256_and_si256(_mm256_srli_epi16(input, 4), low_mask));
+				auto special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+				auto prev2 = prev_bytes<2>(input, st.prev_input);
+				auto prev3 = prev_bytes<3>(input, st.prev_input);
+				auto third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+				auto fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+				auto must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+				st.error = _mm256_or_si256(st.error, _mm256_xor_si256(must23, special));
+				// incomplete_max只关心最后3个字节, 低lane全部是0xff
+				auto max_value = _mm256_inserti128_si256(_mm256_set1_epi8(static_cast<char>(0xff)),
+					_mm_load_si128(reinterpret_cast<const __m128i *>(incomplete_max)), 1);
+				st.prev_incomplete = _mm256_subs_epu8(input, max_value);
+			}
+			st.prev_input = input;
+		}
+
+		TIMAX_TARGET_AVX2 bool validate_avx2(const unsigned char *s, std::size_t length)
+		{
+			avx_state_t st = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+			std::size_t i = 0;
+			for (; i + 32 <= length; i += 32)
+			{
+				check_block(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i)), st);
+			}
+
+			if (i < length)
+			{
+				alignas(32) unsigned char tail[32] = {};
+				std::memcpy(tail, s + i, length - i);
+				check_block(_mm256_load_si256(reinterpret_cast<const __m256i *>(tail)), st);
+			}
+
+			auto error = _mm256_or_si256(st.error, st.prev_incomplete);
+			return _mm256_testz_si256(error, error) != 0;
+		}
+#endif
+
+		struct dispatch_t
+		{
+			kernel_t kernel;
+			const char* name;
+		};
+
+		dispatch_t select_kernel()
+		{
+#ifdef TIMAX_X86_SIMD
+			if (cpu::has_avx2())
+			{
+				return{ validate_avx2, "avx2" };
+			}
+			if (cpu::has_sse41())
+			{
+				return{ validate_sse41, "sse4.1" };
+			}
+#endif
+			return{ validate_scalar, "scalar" };
+		}
+
+		dispatch_t const& dispatch()
+		{
+			static const dispatch_t selected = select_kernel();
+			return selected;
+		}
+
+		// 首字节决定的码点长度, 不合法的首字节由校验函数发现
+		std::size_t sequence_length(unsigned char lead)
+		{
+			return lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+		}
+
+		// 末尾不完整的码点的起始位置, 没有时返回e
+		const unsigned char* incomplete_tail(const unsigned char *s, const unsigned char *e)
+		{
+			std::size_t size = e - s;
+			for (std::size_t k = 1; k <= 3 && k <= size; ++k)
+			{
+				auto c = *(e - k);
+				if ((c & 0xc0) == 0x80)
+				{
+					continue;
+				}
+				return c >= 0xc0 && sequence_length(c) > k ? e - k : e;
+			}
+			return e;
+		}
+	}
+
+	bool utf8_validator::validate(const char* data, std::size_t length)
+	{
+		auto s = reinterpret_cast<const unsigned char *>(data);
+		if (length < min_simd_length)
+		{
+			return validate_scalar(s, length);
+		}
+		return dispatch().kernel(s, length);
+	}
+
+	const char* utf8_validator::kernel()
+	{
+		return dispatch().name;
+	}
+
+	bool utf8_validator::feed(const char* data, std::size_t length)
+	{
+		if (failed_)
+		{
+			return false;
+		}
+
+		auto s = reinterpret_cast<const unsigned char *>(data);
+		auto e = s + length;
+		if (pending_length_ != 0)
+		{
+			// 先补全上一段留下的码点
+			auto need = sequence_length(pending_[0]);
+			while (pending_length_ < need && s != e)
+			{
+				pending_[pending_length_++] = *s++;
+			}
+			if (pending_length_ < need)
+			{
+				return true;
+			}
+			if (!validate_scalar(pending_, need))
+			{
+				failed_ = true;
+				return false;
+			}
+			pending_length_ = 0;
+		}
+
+		auto tail = incomplete_tail(s, e);
+		if (!validate(reinterpret_cast<const char *>(s), tail - s))
+		{
+			failed_ = true;
+			return false;
+		}
+
+		pending_length_ = e - tail;
+		std::memcpy(pending_, tail, pending_length_);
+		return true;
+	}
+
+	bool utf8_validator::finish()
+	{
+		bool ok = !failed_ && pending_length_ == 0;
+		reset();
+		return ok;
+	}
+
+	void utf8_validator::reset()
+	{
+		pending_length_ = 0;
+		failed_ = false;
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+
+namespace timax
+{
+	// UTF-8校验, 运行时按CPU选择AVX2, SSE4.1或逐字节的实现.
+	// 对象用于分段校验: 分片的websocket消息可以在码点中间切开, 收到一段校验一段
+	class utf8_validator
+	{
+	public:
+		static bool validate(const char* data, std::size_t length);
+
+		// 当前使用的实现: "avx2", "sse4.1"或"scalar"
+		static const char* kernel();
+
+		// 返回false时已经可以确定不是合法的UTF-8
+		bool feed(const char* data, std::size_t length);
+
+		// 消息结束, 不能停在码点中间. 之后可以校验下一条消息
+		bool finish();
+
+		void reset();
+
+	private:
+		// 上一段末尾不完整的码点
+		unsigned char pending_[4];
+		std::size_t pending_length_ = 0;
+		bool failed_ = false;
+	};
+}
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "utf8_validator.hpp"
 
 #include <boost/filesystem.hpp>
 #include <algorithm>
@@ -85,6 +86,168 @@ namespace timax
 		return p;
 	}
 
+	namespace
+	{
+		bool parse_digits(const char*& p, const char* end, std::size_t n, int& value)
+		{
+			if (static_cast<std::size_t>(end - p) < n)
+			{
+				return false;
+			}
+
+			value = 0;
+			for (auto e = p + n; p != e; ++p)
+			{
+				if (*p < '0' || *p > '9')
+				{
+					return false;
+				}
+				value = value * 10 + (*p - '0');
+			}
+			return true;
+		}
+
+		bool parse_month(const char*& p, const char* end, int& month)
+		{
+			if (end - p < 3)
+			{
+				return false;
+			}
+
+			for (month = 0; month < 12; ++month)
+			{
+				if (std::equal(p, p + 3, MONTH[month]))
+				{
+					p += 3;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// hh:mm:ss
+		bool parse_time_of_day(const char*& p, const char* end, int& hour, int& min, int& sec)
+		{
+			return parse_digits(p, end, 2, hour) && p != end && *p++ == ':'
+				&& parse_digits(p, end, 2, min) && p != end && *p++ == ':'
+				&& parse_digits(p, end, 2, sec) && hour < 24 && min < 60 && sec < 61;
+		}
+
+		bool expect(const char*& p, const char* end, const char* str)
+		{
+			for (; *str; ++str, ++p)
+			{
+				if (p == end || *p != *str)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// days since 1970-01-01, from Howard Hinnant's date algorithms
+		int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+		{
+			y -= m <= 2;
+			auto era = (y >= 0 ? y : y - 399) / 400;
+			auto yoe = static_cast<unsigned>(y - era * 400);
+			auto doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+			auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + static_cast<int64_t>(doe) - 719468;
+		}
+	}
+
+	time_t parse_http_date(const char* s, size_t len)
+	{
+		auto p = s;
+		auto end = s + len;
+		while (p != end && std::isalpha(static_cast<unsigned char>(*p)))
+		{
+			++p;
+		}
+		if (p == end)
+		{
+			return -1;
+		}
+
+		int day, month, year, hour, min, sec;
+		if (*p == ',')
+		{
+			// Sun, 06 Nov 1994 08:49:37 GMT
+			// Sunday, 06-Nov-94 08:49:37 GMT
+			++p;
+			if (p == end || *p++ != ' ' || !parse_digits(p, end, 2, day) || p == end)
+			{
+				return -1;
+			}
+
+			auto sep = *p++;
+			if ((sep != ' ' && sep != '-') || !parse_month(p, end, month) || p == end || *p++ != sep)
+			{
+				return -1;
+			}
+
+			if (sep == ' ')
+			{
+				if (!parse_digits(p, end, 4, year))
+				{
+					return -1;
+				}
+			}
+			else
+			{
+				if (!parse_digits(p, end, 2, year))
+				{
+					return -1;
+				}
+				year += year < 70 ? 2000 : 1900;
+			}
+
+			if (!expect(p, end, " ") || !parse_time_of_day(p, end, hour, min, sec) || !expect(p, end, " GMT"))
+			{
+				return -1;
+			}
+		}
+		else if (*p == ' ')
+		{
+			// Sun Nov  6 08:49:37 1994
+			++p;
+			if (!parse_month(p, end, month) || !expect(p, end, " ") || p == end)
+			{
+				return -1;
+			}
+			if (*p == ' ')
+			{
+				++p;
+				if (!parse_digits(p, end, 1, day))
+				{
+					return -1;
+				}
+			}
+			else if (!parse_digits(p, end, 2, day))
+			{
+				return -1;
+			}
+
+			if (!expect(p, end, " ") || !parse_time_of_day(p, end, hour, min, sec)
+				|| !expect(p, end, " ") || !parse_digits(p, end, 4, year))
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			return -1;
+		}
+
+		if (p != end || day < 1 || day > 31)
+		{
+			return -1;
+		}
+
+		auto days = days_from_civil(year, month + 1, day);
+		return static_cast<time_t>(days * 86400 + hour * 3600 + min * 60 + sec);
+	}
 
 	reply reply_static_file(std::string const &static_path, request const &req)
 	{
@@ -93,13 +256,91 @@ namespace timax
             return reply::stock_reply(reply::bad_request);
         }
 		reply rep;
-		if (rep.response_file((boost::filesystem::path(static_path) / req.path().to_string()).generic_string()))
+		if (rep.response_file((boost::filesystem::path(static_path) / req.path().to_string()).generic_string(), req))
 		{
 			return rep;
 		}
 		return reply::stock_reply(reply::not_found);
 	}
 
+	int accept_encoding_qvalue(boost::string_ref accept_encoding, boost::string_ref coding)
+	{
+		int qvalue = -1;
+		int wildcard = -1;
+		while (!accept_encoding.empty())
+		{
+			auto pos = accept_encoding.find(',');
+			auto item = accept_encoding.substr(0, pos);
+			accept_encoding = pos == boost::string_ref::npos ? boost::string_ref() : accept_encoding.substr(pos + 1);
+
+			auto semi = item.find(';');
+			auto name = item.substr(0, semi);
+			while (!name.empty() && (name.front() == ' ' || name.front() == '\t'))
+			{
+				name.remove_prefix(1);
+			}
+			while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+			{
+				name.remove_suffix(1);
+			}
+
+			// q=0.5 -> 500
+			int q = 1000;
+			if (semi != boost::string_ref::npos)
+			{
+				auto params = item.substr(semi + 1);
+				auto qpos = params.find("q=");
+				if (qpos == boost::string_ref::npos)
+				{
+					qpos = params.find("Q=");
+				}
+				if (qpos != boost::string_ref::npos)
+				{
+					auto p = params.substr(qpos + 2);
+					q = 0;
+					int digits = 0;
+					bool frac = false;
+					for (auto c : p)
+					{
+						if (c == '.' && !frac)
+						{
+							frac = true;
+						}
+						else if (c >= '0' && c <= '9' && (!frac || digits < 3))
+						{
+							if (frac)
+							{
+								++digits;
+							}
+							q = q * 10 + (c - '0');
+						}
+						else
+						{
+							break;
+						}
+					}
+					for (; digits < 3; ++digits)
+					{
+						q *= 10;
+					}
+					q = std::min(q, 1000);
+				}
+			}
+
+			if (iequal(name.data(), name.size(), coding.data(), coding.size())
+				|| (iequal(coding.data(), coding.size(), "gzip", 4) && iequal(name.data(), name.size(), "x-gzip", 6)))
+			{
+				qvalue = std::max(qvalue, q);
+			}
+			else if (name == "*")
+			{
+				wildcard = q;
+			}
+		}
+
+		return qvalue != -1 ? qvalue : wildcard;
+	}
+
 	// from h2o
 	size_t base64_encode(char *_dst, const void *_src, size_t len, int url_encoded)
 	{
@@ -152,55 +393,7 @@ namespace timax
 
 	bool is_valid_utf8(unsigned char *s, size_t length)
 	{
-		for (unsigned char *e = s + length; s != e; )
-		{
-			if (s + 4 <= e && ((*(uint32_t *)s) & 0x80808080) == 0)
-			{
-				s += 4;
-			}
-			else
-			{
-				while (!(*s & 0x80))
-				{
-					if (++s == e)
-					{
-						return true;
-					}
-				}
-
-				if ((s[0] & 0x60) == 0x40)
-				{
-					if (s + 1 >= e || (s[1] & 0xc0) != 0x80 || (s[0] & 0xfe) == 0xc0)
-					{
-						return false;
-					}
-					s += 2;
-				}
-				else if ((s[0] & 0xf0) == 0xe0)
-				{
-					if (s + 2 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
-						(s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) || (s[0] == 0xed && (s[1] & 0xe0) == 0xa0))
-					{
-						return false;
-					}
-					s += 3;
-				}
-				else if ((s[0] & 0xf8) == 0xf0)
-				{
-					if (s + 3 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80 ||
-						(s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) || (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4)
-					{
-						return false;
-					}
-					s += 4;
-				}
-				else
-				{
-					return false;
-				}
-			}
-		}
-		return true;
+		return utf8_validator::validate(reinterpret_cast<const char*>(s), length);
 	}
 
 }
@@ -9,6 +9,8 @@ namespace timax
 	bool iequal(const char* src, size_t src_len, const char* dest, size_t dest_len);
 	std::string http_date(time_t t);
 	char *http_date(char *res, time_t t);
+	// 解析IMF-fixdate, RFC 850和asctime格式的HTTP-date, 失败返回-1
+	time_t parse_http_date(const char* s, size_t len);
 
 
 	template<typename T>
@@ -36,6 +38,9 @@ namespace timax
 
     reply reply_static_file(std::string const& static_path, request const& req);
 
+	// Accept-Encoding中coding的q值(0-1000), 未列出且没有"*"时返回-1
+	int accept_encoding_qvalue(boost::string_ref accept_encoding, boost::string_ref coding);
+
 	inline int htoi(int c1, int c2)
 	{
 		int value;
@@ -7,15 +7,79 @@
 #include <openssl/sha.h>
 #include <openssl/md5.h>
 
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
 namespace timax
 {
 	namespace websocket
 	{
+		namespace
+		{
+			boost::string_ref trim(boost::string_ref s)
+			{
+				while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+				{
+					s.remove_prefix(1);
+				}
+				while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+				{
+					s.remove_suffix(1);
+				}
+				return s;
+			}
+
+			// sep֮ǰĲ, sΪsep֮Ĳ
+			boost::string_ref split(boost::string_ref& s, char sep)
+			{
+				auto pos = s.find(sep);
+				auto head = s.substr(0, pos);
+				s = pos == boost::string_ref::npos ? boost::string_ref() : s.substr(pos + 1);
+				return trim(head);
+			}
+
+			bool is_param(boost::string_ref key, const char* name)
+			{
+				return iequal(key.data(), key.size(), name, std::strlen(name));
+			}
+
+			// 8~15, Դ, 0
+			int parse_window_bits(boost::string_ref value)
+			{
+				if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+				{
+					value = value.substr(1, value.size() - 2);
+				}
+				if (value.empty() || value.size() > 2)
+				{
+					return 0;
+				}
+
+				int bits = 0;
+				for (auto c : value)
+				{
+					if (c < '0' || c > '9')
+					{
+						return 0;
+					}
+					bits = bits * 10 + c - '0';
+				}
+				return bits >= 8 && bits <= 15 ? bits : 0;
+			}
+		}
 
 		websocket_connection::websocket_connection(boost::shared_ptr<reply::connection> conn, ws_config_t cfg)
-			:conn_(std::move(conn)), buffer_(8192 + LONG_MESSAGE_HEADER), cfg_(std::move(cfg))
+			:conn_(std::move(conn)), buffer_(MIN_RECEIVE_BUFFER + LONG_MESSAGE_HEADER), io_thread_(boost::this_thread::get_id()), cfg_(std::move(cfg))
 		{
-
+			if (cfg_.high_watermark == 0)
+			{
+				cfg_.high_watermark = 16 * 1024 * 1024;
+			}
+			if (cfg_.low_watermark == 0)
+			{
+				cfg_.low_watermark = std::min<std::size_t>(1024 * 1024, cfg_.high_watermark / 2);
+			}
 		}
 
 		boost::string_ref websocket_connection::is_websocket_handshake(const request& req)
@@ -67,8 +131,18 @@ namespace timax
 				rep.add_header("Sec-WebSocket-Protocol", protocal_str.to_string());
 			}
 
+			deflate_params_t deflate;
+			if (cfg.permessage_deflate)
+			{
+				std::string extensions;
+				if (negotiate_deflate(req.get_header("sec-websocket-extensions", 24), cfg, deflate, extensions))
+				{
+					rep.add_header("Sec-WebSocket-Extensions", std::move(extensions));
+				}
+			}
+
 			auto conn = rep.get_connection();
-			conn->async_write(nullptr, 0, [conn, cfg](boost::system::error_code const& ec, size_t)
+			conn->async_write(nullptr, 0, [conn, cfg, deflate](boost::system::error_code const& ec, size_t)
 			{
 				if (ec)
 				{
@@ -81,16 +155,447 @@ namespace timax
 
 
 				auto ws_conn = boost::make_shared<websocket_connection>(conn, std::move(cfg));
+				ws_conn->deflate_ = deflate;
+				ws_conn->last_read_ = timing_wheel::now();
+				ws_conn->arm_timer();
+				ws_conn->join_balancer();
 				ws_conn->start();
 			});
 
 		}
 
+		bool websocket_connection::negotiate_deflate(boost::string_ref offers, ws_config_t const& cfg, deflate_params_t& params, std::string& response)
+		{
+			// zlibraw deflate֧8
+			int window_bits = cfg.deflate_window_bits == 0 ? 13 : std::max(9, std::min(15, cfg.deflate_window_bits));
+
+			// ͻ˸˳, ܵһoffer
+			while (!offers.empty())
+			{
+				auto offer = split(offers, ',');
+				auto name = split(offer, ';');
+				if (!is_param(name, "permessage-deflate"))
+				{
+					continue;
+				}
+
+				deflate_params_t p;
+				p.enabled = true;
+				p.server_window_bits = window_bits;
+				p.server_no_context_takeover = cfg.deflate_no_context_takeover;
+				bool client_bits_offered = false;
+				unsigned seen = 0;
+				bool ok = true;
+				while (ok && !offer.empty())
+				{
+					auto param = split(offer, ';');
+					auto key = split(param, '=');
+					auto value = trim(param);
+
+					unsigned flag = 0;
+					if (is_param(key, "server_no_context_takeover"))
+					{
+						flag = 1;
+						ok = value.empty();
+						p.server_no_context_takeover = true;
+					}
+					else if (is_param(key, "client_no_context_takeover"))
+					{
+						flag = 2;
+						ok = value.empty();
+						p.client_no_context_takeover = true;
+					}
+					else if (is_param(key, "server_max_window_bits"))
+					{
+						flag = 4;
+						auto bits = parse_window_bits(value);
+						ok = bits >= 9;
+						p.server_window_bits = std::min(window_bits, bits);
+					}
+					else if (is_param(key, "client_max_window_bits"))
+					{
+						flag = 8;
+						client_bits_offered = true;
+						if (!value.empty())
+						{
+							auto bits = parse_window_bits(value);
+							ok = bits != 0;
+							p.client_window_bits = bits;
+						}
+					}
+
+					// ʶĲظĲҪܾoffer
+					ok = ok && flag != 0 && (seen & flag) == 0;
+					seen |= flag;
+				}
+				if (!ok)
+				{
+					continue;
+				}
+
+				// ͻ֧ʱҲĴ, շڴͲ1 << window_bits
+				if (client_bits_offered)
+				{
+					p.client_window_bits = std::min(p.client_window_bits, window_bits);
+				}
+
+				response = "permessage-deflate";
+				if (p.server_no_context_takeover)
+				{
+					response += "; server_no_context_takeover";
+				}
+				if (p.client_no_context_takeover)
+				{
+					response += "; client_no_context_takeover";
+				}
+				if (p.server_window_bits < 15)
+				{
+					response += "; server_max_window_bits=" + std::to_string(p.server_window_bits);
+				}
+				if (client_bits_offered && p.client_window_bits < 15)
+				{
+					response += "; client_max_window_bits=" + std::to_string(p.client_window_bits);
+				}
+				params = p;
+				return true;
+			}
+			return false;
+		}
+
+		bool websocket_connection::inflate_message(char *&data, std::size_t &length)
+		{
+			static const char tail[] = { '\x00', '\x00', '\xff', '\xff' };
+			static const std::size_t max_message_size = 16 * 1024 * 1024;
+
+			compressed_message_ = false;
+			if (!inflater_)
+			{
+				inflater_ = boost::make_shared<compression::inflate_stream>(-std::max(9, deflate_.client_window_bits));
+			}
+
+			// һܴϢµڴ治ٱ
+			if (inflate_buffer_.capacity() > 1024 * 1024)
+			{
+				std::string().swap(inflate_buffer_);
+			}
+			inflate_buffer_.clear();
+
+			// ͷȥsync flushβ00 00 ff ff
+			if (!inflater_->write(data, length, inflate_buffer_, max_message_size)
+				|| !inflater_->write(tail, sizeof(tail), inflate_buffer_, max_message_size))
+			{
+				return false;
+			}
+			if (deflate_.client_no_context_takeover)
+			{
+				inflater_->reset();
+			}
+
+			data = &inflate_buffer_[0];
+			length = inflate_buffer_.size();
+			return true;
+		}
+
+		bool websocket_connection::deflate_frame(send_frame_t& frame, bool first, bool fin)
+		{
+			// ̵̫Ϣѹ󷴶. ƬϢҪôÿƬѹ, Ҫôѹ
+			static const std::size_t min_deflate_size = 64;
+			if (first)
+			{
+				deflating_ = deflate_.enabled && (frame.length >= min_deflate_size || !fin);
+			}
+			if (!deflating_)
+			{
+				return true;
+			}
+
+			if (!deflater_)
+			{
+				auto bits = deflate_.server_window_bits;
+				deflater_ = boost::make_shared<compression::deflate_stream>(-bits, compression::config().level, bits - 7);
+			}
+
+			std::string out;
+			out.reserve(frame.length / 2 + 64);
+			bool ok = true;
+			if (frame.chain.empty())
+			{
+				ok = deflater_->write(frame.data ? frame.data : frame.owned.data(), frame.length, Z_SYNC_FLUSH, out);
+			}
+			else
+			{
+				for (auto const& b : frame.chain)
+				{
+					ok = ok && deflater_->write(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b), Z_NO_FLUSH, out);
+				}
+				ok = ok && deflater_->write("", 0, Z_SYNC_FLUSH, out);
+			}
+			if (!ok || out.size() < 4)
+			{
+				return false;
+			}
+
+			// ֻϢȥsync flushβ00 00 ff ff
+			if (fin)
+			{
+				out.resize(out.size() - 4);
+				if (deflate_.server_no_context_takeover)
+				{
+					deflater_->reset();
+				}
+			}
+
+			frame.owned = std::move(out);
+			frame.data = nullptr;
+			frame.chain.clear();
+			frame.length = frame.owned.size();
+			return true;
+		}
+
 		void websocket_connection::start()
 		{
+			// workerʱȲ, TCPöԷ
+			if (pending_bytes_ > max_pending_bytes())
+			{
+				read_paused_ = true;
+				return;
+			}
+
+			auto self = this->shared_from_this();
+			auto ios = &conn_->get_io_service();
+			conn_->async_read_some(buffer_.data() + LONG_MESSAGE_HEADER, buffer_.size() - LONG_MESSAGE_HEADER, [self, this, ios](boost::system::error_code const& ec, std::size_t length)
+			{
+				// ĹǨ, صھɵio_service
+				if (&conn_->get_io_service() != ios)
+				{
+					conn_->get_io_service().post([self, this, ec, length] { on_read(ec, length); });
+					return;
+				}
+				on_read(ec, length);
+			});
+		}
+
+		void websocket_connection::on_read(boost::system::error_code const& ec, std::size_t length)
+		{
+			if (migrating_)
+			{
+				migrating_ = false;
+				{
+					boost::lock_guard<boost::mutex> lock(send_mutex_);
+					io_thread_ = boost::this_thread::get_id();
+				}
+				join_balancer();
+				arm_timer();
+				if (ec == boost::asio::error::operation_aborted)
+				{
+					start();
+					return;
+				}
+			}
+
+			if (ec)
+			{
+				if (cfg_.on_error)
+				{
+					cfg_.on_error(ec);
+				}
+				return;
+			}
+
+			last_read_ = timing_wheel::now();
+			consume(buffer_.data() + LONG_MESSAGE_HEADER, length, nullptr);
+			if (!reading_payload_)
+			{
+				adapt_buffer(length);
+				start();
+			}
+		}
+
+		void websocket_connection::join_balancer()
+		{
+			// ǨƵӲbalancer, ڵio_serviceܱǨһ
+			if (!conn_->can_migrate())
+			{
+				return;
+			}
+
+			boost::weak_ptr<websocket_connection> weak = this->shared_from_this();
+			auto ios = &conn_->get_io_service();
+			balancer_ = connection_balancer::get(*ios).add([weak, ios](boost::asio::io_service& to)
+			{
+				// ѾǨߵھɵbalancerϻһ
+				auto self = weak.lock();
+				return self && &self->conn_->get_io_service() == ios && self->migrate(to);
+			});
+		}
+
+		bool websocket_connection::migrate(boost::asio::io_service& to)
+		{
+			// ֻζ֮Ǩ: һasync_read_someûбĲڽ
+			if (!conn_->can_migrate() || &to == &conn_->get_io_service() || migrating_ || reading_payload_ || read_paused_ || pending_bytes_
+				|| writing_ || !control_queue_.empty() || !data_queue_.empty() || shutting_down || is_closed())
+			{
+				return false;
+			}
+
+			timing_wheel::cancel(timer_);
+			if (!conn_->migrate(to))
+			{
+				arm_timer();
+				return false;
+			}
+			migrating_ = true;
+			return true;
+		}
+
+		void websocket_connection::adapt_buffer(std::size_t read_length)
+		{
+			auto capacity = buffer_.size() - LONG_MESSAGE_HEADER;
+			auto wanted = capacity;
+			if (read_length == capacity)
+			{
+				wanted = capacity * 2;
+			}
+
+			// ûֱӶ֡, һζܷʣµpayload
+			if (state == READ_MESSAGE)
+			{
+				while (wanted < remaining_bytes && wanted < MAX_RECEIVE_BUFFER)
+				{
+					wanted *= 2;
+				}
+			}
+
+			if (wanted > capacity && capacity < MAX_RECEIVE_BUFFER)
+			{
+				small_reads_ = 0;
+				std::vector<char>((wanted < MAX_RECEIVE_BUFFER ? wanted : MAX_RECEIVE_BUFFER) + LONG_MESSAGE_HEADER).swap(buffer_);
+			}
+			else if (read_length < capacity / 4 && capacity > MIN_RECEIVE_BUFFER)
+			{
+				if (++small_reads_ == SHRINK_AFTER_READS)
+				{
+					small_reads_ = 0;
+					std::vector<char>(capacity / 2 + LONG_MESSAGE_HEADER).swap(buffer_);
+				}
+			}
+			else
+			{
+				small_reads_ = 0;
+			}
+		}
+
+		void websocket_connection::arm_timer()
+		{
+			uint64_t ping_ms = static_cast<uint64_t>(cfg_.ping_interval) * 1000;
+			uint64_t pong_ms = cfg_.pong_timeout ? static_cast<uint64_t>(cfg_.pong_timeout) * 1000 : ping_ms;
+			uint64_t idle_ms = static_cast<uint64_t>(cfg_.idle_timeout) * 1000;
+
+			uint64_t next = 0;
+			auto earliest = [&next](uint64_t t)
+			{
+				if (next == 0 || t < next)
+				{
+					next = t;
+				}
+			};
+			if (awaiting_pong_)
+			{
+				earliest(ping_sent_ + pong_ms);
+			}
+			else if (ping_ms)
+			{
+				earliest(last_read_ + ping_ms);
+			}
+			if (idle_ms)
+			{
+				earliest(last_read_ + idle_ms);
+			}
+			if (next == 0)
+			{
+				return;
+			}
+
+			// յʱʱ, ʱٰlast_read_¼
+			auto now = timing_wheel::now();
+			schedule_timer(next > now ? next - now : 0);
+		}
+
+		void websocket_connection::schedule_timer(uint64_t delay_ms)
+		{
+			// ʱֲӳӵ
+			boost::weak_ptr<websocket_connection> weak = this->shared_from_this();
+			timing_wheel::cancel(timer_);
+			timer_ = timing_wheel::get(conn_->get_io_service()).schedule(delay_ms, [weak]
+			{
+				if (auto self = weak.lock())
+				{
+					self->on_timer();
+				}
+			});
+		}
+
+		void websocket_connection::on_timer()
+		{
+			timer_.reset();
+			if (is_closed())
+			{
+				return;
+			}
+
+			// closeֳʱ
+			if (shutting_down)
+			{
+				conn_->close();
+				return;
+			}
+
+			auto now = timing_wheel::now();
+			if (read_paused_)
+			{
+				// ûж, Է(pong)TCP, 
+				last_read_ = now;
+				awaiting_pong_ = false;
+			}
+
+			uint64_t ping_ms = static_cast<uint64_t>(cfg_.ping_interval) * 1000;
+			uint64_t pong_ms = cfg_.pong_timeout ? static_cast<uint64_t>(cfg_.pong_timeout) * 1000 : ping_ms;
+			if (awaiting_pong_ && now - ping_sent_ >= pong_ms)
+			{
+				// ԷѾӦ, close
+				conn_->close();
+				return;
+			}
+
+			if (cfg_.idle_timeout && now - last_read_ >= static_cast<uint64_t>(cfg_.idle_timeout) * 1000)
+			{
+				static char reason[] = "idle timeout";
+				close(1001, reason, sizeof(reason) - 1);
+				return;
+			}
+
+			if (ping_ms && !awaiting_pong_ && now - last_read_ >= ping_ms)
+			{
+				awaiting_pong_ = true;
+				ping_sent_ = now;
+				async_send_msg("", 0, PING, {});
+			}
+			arm_timer();
+		}
+
+		void websocket_connection::read_payload(void *user)
+		{
+			// resize, ʡ˰ջСһζεĸ
+			auto offset = fragment_buffer.size();
+			auto length = remaining_bytes;
+			fragment_buffer.resize(offset + length);
+
+			reading_payload_ = true;
 			auto self = this->shared_from_this();
-			conn_->async_read_some(buffer_.data() + LONG_MESSAGE_HEADER, buffer_.size() - LONG_MESSAGE_HEADER, [self, this](boost::system::error_code const& ec, std::size_t length)
+			conn_->async_read(&fragment_buffer[offset], length, [self, this, offset, length, user](boost::system::error_code const& ec, std::size_t)
 			{
+				reading_payload_ = false;
+				last_read_ = timing_wheel::now();
 				if (ec)
 				{
 					if (cfg_.on_error)
@@ -100,75 +605,462 @@ namespace timax
 					return;
 				}
 
-				consume(buffer_.data() + LONG_MESSAGE_HEADER, length, nullptr);
+				auto data = &fragment_buffer[offset];
+				unmask(data, data, length, mask);
+				remaining_bytes = 0;
+				state = READ_HEAD;
+
+				auto op = opcode[(unsigned char)op_stack];
+				if (op == 1 && !compressed_message_ && !utf8_.feed(data, length))
+				{
+					force_close(user);
+					return;
+				}
+				if (last_fin)
+				{
+					if (finish_fragments(op, user))
+					{
+						return;
+					}
+					op_stack--;
+				}
 				start();
 			});
 		}
 
 		void websocket_connection::async_send_msg(const char* data, std::size_t length, opcode_t opCode, async_write_msg_callback_t handler)
 		{
-			auto buffers = format_message(data, length, opCode);
-			conn_->async_write(buffers, [handler](boost::system::error_code const& ec, std::size_t)
+			send_frame_t frame;
+			frame.opcode = opCode;
+			frame.length = length;
+			if (opCode >= CLOSE)
 			{
-				handler(ec);
-			});
+				frame.owned.assign(data, length);
+				frame.data = nullptr;
+			}
+			else
+			{
+				frame.data = data;
+			}
+			frame.handler = std::move(handler);
+			send_frame(std::move(frame));
 		}
 
-		void websocket_connection::close(int code, char *message, size_t length)
+		void websocket_connection::async_send_msg(std::vector<boost::asio::const_buffer> buffers, opcode_t opCode, async_write_msg_callback_t handler)
 		{
-			static const int MAX_CLOSE_PAYLOAD = 123;
-			length = std::min<size_t>(MAX_CLOSE_PAYLOAD, length);
-			if (cfg_.on_close)
+			send_frame_t frame;
+			frame.opcode = opCode;
+			frame.length = boost::asio::buffer_size(buffers);
+			if (opCode >= CLOSE)
 			{
-				cfg_.on_close(this->shared_from_this(), boost::string_ref(message, length), (opcode_t)code);
+				frame.owned.resize(frame.length);
+				boost::asio::buffer_copy(boost::asio::buffer(&frame.owned[0], frame.length), buffers);
 			}
-			shutting_down = true;
-//TODO: Timer
-// 				startTimeout<WebSocket<isServer>::onEnd>();
+			else
+			{
+				frame.chain = std::move(buffers);
+			}
+			frame.handler = std::move(handler);
+			send_frame(std::move(frame));
+		}
 
-// 			char close_payload[MAX_CLOSE_PAYLOAD + 2];
-			boost::shared_array<char> close_payload(new char[MAX_CLOSE_PAYLOAD + 2]);
-			std::size_t close_payload_length = format_close_payload(close_payload.get(), code, message, length);
+		void websocket_connection::async_send_stream(opcode_t opCode, stream_producer_t producer, async_write_msg_callback_t handler)
+		{
+			send_frame_t frame;
+			frame.opcode = opCode;
+			frame.producer = std::move(producer);
+			frame.handler = std::move(handler);
+			send_frame(std::move(frame));
+		}
+
+		boost::shared_ptr<std::string const> websocket_connection::make_frame(const char* data, std::size_t length, opcode_t opCode)
+		{
+			char header[10];
+			auto header_length = format_header(header, length, opCode);
+			auto frame = boost::make_shared<std::string>();
+			frame->reserve(header_length + length);
+			frame->append(header, header_length);
+			frame->append(data, length);
+			return frame;
+		}
+
+		void websocket_connection::async_send_frame(boost::shared_ptr<std::string const> framed, opcode_t opCode, async_write_msg_callback_t handler)
+		{
+			send_frame_t frame;
+			frame.opcode = opCode;
+			frame.framed = true;
+			frame.data = framed->data();
+			frame.length = framed->size();
+			frame.shared = std::move(framed);
+			frame.handler = std::move(handler);
+			send_frame(std::move(frame));
+		}
+
+		void websocket_connection::send_frame(send_frame_t frame)
+		{
 			auto self = this->shared_from_this();
-			async_send_msg(close_payload.get(), close_payload_length, opcode_t::CLOSE, [close_payload, self, this](boost::system::error_code const& ec)
+			auto& ios = conn_->get_io_service();
+			auto fail = [&ios, &frame](boost::system::error_code const& ec)
 			{
-				if (ec)
+				if (frame.handler)
 				{
-					conn_->close();
+					auto handler = std::move(frame.handler);
+					ios.post([handler, ec] { handler(ec); });
 				}
-				else
+			};
+
+			auto length = frame.length;
+			frame.accounted = frame.opcode < CLOSE ? length : 0;
+			if (frame.opcode < CLOSE)
+			{
+				boost::unique_lock<boost::mutex> lock(send_mutex_);
+				if (shutting_down || send_failed_)
 				{
-					conn_->shutdown([](boost::system::error_code const&) {});
+					lock.unlock();
+					fail(boost::asio::error::shut_down);
+					return;
+				}
+
+				// ΪʱٴϢҲճ
+				if (buffered_ != 0 && buffered_ + length > cfg_.high_watermark)
+				{
+					switch (cfg_.slow_consumer)
+					{
+					case slow_consumer_drop:
+						lock.unlock();
+						fail(boost::asio::error::no_buffer_space);
+						return;
+					case slow_consumer_block:
+						// io߳еȴ
+						if (boost::this_thread::get_id() != io_thread_)
+						{
+							drained_.wait(lock, [this] { return buffered_ <= cfg_.low_watermark || send_failed_; });
+							if (send_failed_)
+							{
+								lock.unlock();
+								fail(boost::asio::error::shut_down);
+								return;
+							}
+						}
+						break;
+					default:
+						send_failed_ = true;
+						lock.unlock();
+						run_in_io([this] { conn_->close(); });
+						fail(boost::asio::error::no_buffer_space);
+						return;
+					}
+				}
+
+				buffered_ += length;
+				if (buffered_ > cfg_.high_watermark)
+				{
+					above_high_watermark_ = true;
 				}
+			}
+
+			// ֻio߳޸
+			run_in_io([this, frame]() mutable
+			{
+				queue_frame(std::move(frame));
 			});
 		}
 
-		void websocket_connection::unmask_imprecise(char *dst, char *src, char *mask, std::size_t length)
+		std::size_t websocket_connection::buffered_amount()
+		{
+			boost::lock_guard<boost::mutex> lock(send_mutex_);
+			return buffered_;
+		}
+
+		void websocket_connection::queue_frame(send_frame_t frame)
 		{
-			for (std::size_t n = (length >> 2) + 1; n; n--)
+			// ping/pong, close֡һŶ, ֤closeһ֡
+			if (frame.opcode == PING || frame.opcode == PONG)
+			{
+				control_queue_.push_back(std::move(frame));
+			}
+			else
+			{
+				data_queue_.push_back(std::move(frame));
+			}
+
+			if (!writing_)
 			{
-				*(dst++) = *(src++) ^ mask[0];
-				*(dst++) = *(src++) ^ mask[1];
-				*(dst++) = *(src++) ^ mask[2];
-				*(dst++) = *(src++) ^ mask[3];
+				flush_send_queue();
 			}
 		}
 
-		void websocket_connection::unmask_imprecise_copy_mask(char *dst, char *src, char *mask_ptr, std::size_t length)
+		namespace
 		{
-			char mask[4] = { mask_ptr[0], mask_ptr[1], mask_ptr[2], mask_ptr[3] };
-			unmask_imprecise(dst, src, mask, length);
+			std::vector<boost::asio::const_buffer> slice_buffers(std::vector<boost::asio::const_buffer> const& chain, std::size_t offset, std::size_t length)
+			{
+				std::vector<boost::asio::const_buffer> out;
+				for (auto const& b : chain)
+				{
+					auto size = boost::asio::buffer_size(b);
+					if (offset >= size)
+					{
+						offset -= size;
+						continue;
+					}
+
+					auto n = std::min(size - offset, length);
+					out.push_back(boost::asio::buffer(boost::asio::buffer_cast<const char*>(b) + offset, n));
+					offset = 0;
+					length -= n;
+					if (length == 0)
+					{
+						break;
+					}
+				}
+				return out;
+			}
+		}
+
+		void websocket_connection::flush_send_queue()
+		{
+			bool failed;
+			{
+				boost::lock_guard<boost::mutex> lock(send_mutex_);
+				failed = send_failed_;
+			}
+			if (failed)
+			{
+				// дʧܺȡһ
+				std::vector<send_frame_t> dropped;
+				std::move(control_queue_.begin(), control_queue_.end(), std::back_inserter(dropped));
+				std::move(data_queue_.begin(), data_queue_.end(), std::back_inserter(dropped));
+				control_queue_.clear();
+				data_queue_.clear();
+				for (auto& f : dropped)
+				{
+					if (f.handler)
+					{
+						f.handler(boost::asio::error::shut_down);
+					}
+				}
+				return;
+			}
+
+			// Ŷӵ֡ϲһд
+			auto frames = boost::make_shared<std::vector<send_frame_t>>();
+			frames->reserve(control_queue_.size() + data_queue_.size());
+			for (auto& f : control_queue_)
+			{
+				f.header_length = format_header(f.header, f.length, f.opcode);
+				frames->push_back(std::move(f));
+			}
+			control_queue_.clear();
+
+			// Ϣд; ƬϢֻдһƬ, ʣµڶ, ֡Բ嵽Ƭ֮
+			while (!data_queue_.empty())
+			{
+				auto& f = data_queue_.front();
+				if (f.framed)
+				{
+					frames->push_back(std::move(f));
+					data_queue_.pop_front();
+					continue;
+				}
+
+				bool first = !f.started;
+				bool fin = true;
+				bool whole = false;
+				send_frame_t frame;
+				frame.opcode = f.opcode;
+				if (f.producer)
+				{
+					fin = !f.producer(frame.owned);
+					frame.length = frame.owned.size();
+					frame.accounted = frame.length;
+
+					boost::lock_guard<boost::mutex> lock(send_mutex_);
+					buffered_ += frame.length;
+					if (buffered_ > cfg_.high_watermark)
+					{
+						above_high_watermark_ = true;
+					}
+				}
+				else if (first && (cfg_.fragment_size == 0 || f.length <= cfg_.fragment_size || f.opcode >= CLOSE))
+				{
+					frame = std::move(f);
+					whole = true;
+				}
+				else
+				{
+					auto n = std::min(f.length - f.sent, cfg_.fragment_size);
+					fin = f.sent + n == f.length;
+					if (f.chain.empty())
+					{
+						frame.data = f.data + f.sent;
+					}
+					else
+					{
+						frame.chain = slice_buffers(f.chain, f.sent, n);
+					}
+					frame.length = n;
+					frame.accounted = n;
+					f.sent += n;
+				}
+
+				if (frame.opcode < CLOSE && !deflate_frame(frame, first, fin))
+				{
+					// ѹѾ, һ֮֡Ķٷ
+					{
+						boost::lock_guard<boost::mutex> lock(send_mutex_);
+						send_failed_ = true;
+					}
+					drained_.notify_all();
+					conn_->close();
+
+					if (whole)
+					{
+						data_queue_.pop_front();
+					}
+					frames->push_back(std::move(frame));
+					for (auto& f : *frames)
+					{
+						if (f.handler)
+						{
+							f.handler(boost::asio::error::shut_down);
+						}
+					}
+					// ʣµʧܷ֧֪ͨ
+					flush_send_queue();
+					return;
+				}
+
+				int flags = (first ? 0 : SND_CONTINUATION) | (fin ? 0 : SND_NO_FIN);
+				if (first && deflating_ && frame.opcode < CLOSE)
+				{
+					flags |= SND_COMPRESSED;
+				}
+				frame.header_length = format_header(frame.header, frame.length, frame.opcode, flags);
+
+				if (!fin)
+				{
+					f.started = true;
+					frames->push_back(std::move(frame));
+					break;
+				}
+
+				if (!whole)
+				{
+					frame.handler = std::move(f.handler);
+				}
+				data_queue_.pop_front();
+				frames->push_back(std::move(frame));
+			}
+
+			std::vector<boost::asio::const_buffer> buffers;
+			buffers.reserve(frames->size() * 2);
+			std::size_t data_bytes = 0;
+			for (auto const& f : *frames)
+			{
+				if (f.header_length != 0)
+				{
+					buffers.emplace_back(boost::asio::buffer(f.header, f.header_length));
+				}
+				if (!f.chain.empty())
+				{
+					buffers.insert(buffers.end(), f.chain.begin(), f.chain.end());
+				}
+				else if (f.length != 0)
+				{
+					buffers.emplace_back(boost::asio::buffer(f.data ? f.data : f.owned.data(), f.length));
+				}
+				data_bytes += f.accounted;
+			}
+
+			writing_ = true;
+			auto self = this->shared_from_this();
+			conn_->async_write(buffers, [self, this, frames, data_bytes](boost::system::error_code const& ec, std::size_t)
+			{
+				bool drained = false;
+				{
+					boost::lock_guard<boost::mutex> lock(send_mutex_);
+					buffered_ -= data_bytes;
+					if (ec)
+					{
+						send_failed_ = true;
+					}
+					if (above_high_watermark_ && buffered_ <= cfg_.low_watermark)
+					{
+						above_high_watermark_ = false;
+						drained = true;
+					}
+				}
+				drained_.notify_all();
+
+				for (auto& f : *frames)
+				{
+					if (f.handler)
+					{
+						f.handler(ec);
+					}
+				}
+
+				if (drained && !ec && cfg_.on_drain)
+				{
+					cfg_.on_drain(self);
+				}
+
+				// handlerύ֡ѾŶ, һд
+				writing_ = false;
+				if (!control_queue_.empty() || !data_queue_.empty())
+				{
+					flush_send_queue();
+				}
+			});
 		}
 
-		void websocket_connection::unmask_inplace(char *data, char *stop, char *mask)
+		void websocket_connection::close(int code, char *message, size_t length)
 		{
-			while (data < stop)
+			static const int MAX_CLOSE_PAYLOAD = 123;
+			// ȷclose, ǶԷĻӦ; ߳ͬʱclose, ֻһCLOSE֡
+			if (shutting_down.exchange(true))
+			{
+				run_in_io([this] { conn_->close(); });
+				return;
+			}
+
+			length = std::min<size_t>(MAX_CLOSE_PAYLOAD, length);
+			if (cfg_.on_close && worker_strand_)
+			{
+				// ڻûϢ
+				auto self = this->shared_from_this();
+				std::string reason(message, length);
+				worker_strand_->post([self, this, reason, code]
+				{
+					cfg_.on_close(self, boost::string_ref(reason), (opcode_t)code);
+				});
+			}
+			else if (cfg_.on_close)
 			{
-				*(data++) ^= mask[0];
-				*(data++) ^= mask[1];
-				*(data++) ^= mask[2];
-				*(data++) ^= mask[3];
+				cfg_.on_close(this->shared_from_this(), boost::string_ref(message, length), (opcode_t)code);
 			}
+
+			// Էһֱرʱǿƹر
+			auto self = this->shared_from_this();
+			run_in_io([this]
+			{
+				schedule_timer(cfg_.close_timeout ? static_cast<uint64_t>(cfg_.close_timeout) * 1000 : 5000);
+			});
+
+// 			char close_payload[MAX_CLOSE_PAYLOAD + 2];
+			boost::shared_array<char> close_payload(new char[MAX_CLOSE_PAYLOAD + 2]);
+			std::size_t close_payload_length = format_close_payload(close_payload.get(), code, message, length);
+			async_send_msg(close_payload.get(), close_payload_length, opcode_t::CLOSE, [close_payload, self, this](boost::system::error_code const& ec)
+			{
+				if (ec)
+				{
+					conn_->close();
+				}
+				else
+				{
+					conn_->shutdown([](boost::system::error_code const&) {});
+				}
+			});
 		}
 
 		void websocket_connection::rotate_mask(unsigned int offset, char *mask)
@@ -212,7 +1104,7 @@ namespace timax
 					std::memcpy(&frame, src, sizeof(frame_format_t));
 
 					// invalid reserved bits / invalid opcodes / invalid control frames / set compressed frame
-					if ((rsv1(frame) && !set_compressed(user)) || rsv23(frame) || (get_opcode(frame) > 2 && get_opcode(frame) < 8) ||
+					if ((rsv1(frame) && !set_compressed(frame)) || rsv23(frame) || (get_opcode(frame) > 2 && get_opcode(frame) < 8) ||
 						get_opcode(frame) > 10 || (get_opcode(frame) > 2 && (!is_fin(frame) || payload_length(frame) > 125)))
 					{
 						force_close(user);
@@ -262,12 +1154,7 @@ namespace timax
 		{
 			if (remaining_bytes <= length)
 			{
-				std::size_t n = remaining_bytes >> 2;
-				unmask_inplace(src, src + n * 4, mask);
-				for (int i = 0, s = remaining_bytes % 4; i < s; i++)
-				{
-					src[n * 4 + i] ^= mask[i];
-				}
+				unmask(src, src, remaining_bytes, mask);
 
 				if (handle_fragment(src, remaining_bytes, 0, opcode[(unsigned char)op_stack], last_fin != 0, user))
 				{
@@ -286,7 +1173,7 @@ namespace timax
 			}
 			else
 			{
-				unmask_inplace(src, src + ((length >> 2) + 1) * 4, mask);
+				unmask(src, src, length, mask);
 
 				remaining_bytes -= length;
 				if (handle_fragment(src, length, remaining_bytes, opcode[(unsigned char)op_stack], last_fin != 0, user))
@@ -308,69 +1195,35 @@ namespace timax
 			{
 				if (!remaining_bytes && fin && !fragment_buffer.length())
 				{
-// 					if (webSocketData->compressionStatus == WebSocket<isServer>::Data::CompressionStatus::COMPRESSED_FRAME)
-// 					{
-// 						webSocketData->compressionStatus = WebSocket<isServer>::Data::CompressionStatus::ENABLED;
-// 						Hub *hub = ((Group<isServer> *) s.getSocketData()->nodeData)->hub;
-// 						data = hub->inflate(data, length);
-// 						if (!data)
-// 						{
-// 							forceClose(user);
-// 							return true;
-// 						}
-// 					}
-
-					if (opcode == 1 && !is_valid_utf8((unsigned char *)data, length))
+					if (compressed_message_ && !inflate_message(data, length))
 					{
 						force_close(user);
 						return true;
 					}
-					if (cfg_.on_message)
+
+					if (opcode == 1 && !is_valid_utf8((unsigned char *)data, length))
 					{
-						cfg_.on_message(this->shared_from_this(), boost::string_ref(data, length), (opcode_t)opcode);
+						force_close(user);
+						return true;
 					}
-					if (is_closed() || is_shutting_down())
+					if (deliver_message(data, length, opcode, nullptr))
 					{
 						return true;
 					}
 				}
 				else
 				{
+					// ѹϢҪѹУ
+					if (opcode == 1 && !compressed_message_ && !utf8_.feed(data, length))
+					{
+						force_close(user);
+						return true;
+					}
+
 					fragment_buffer.append(data, length);
 					if (!remaining_bytes && fin)
 					{
-						length = fragment_buffer.length();
-// 						if (webSocketData->compressionStatus == WebSocket<isServer>::Data::CompressionStatus::COMPRESSED_FRAME)
-// 						{
-// 							webSocketData->compressionStatus = WebSocket<isServer>::Data::CompressionStatus::ENABLED;
-// 							Hub *hub = ((Group<isServer> *) s.getSocketData()->nodeData)->hub;
-// 							webSocketData->fragmentBuffer.append("....");
-// 							data = hub->inflate((char *)webSocketData->fragmentBuffer.data(), length);
-// 							if (!data)
-// 							{
-// 								forceClose(user);
-// 								return true;
-// 							}
-// 						}
-// 						else
-// 						{
-						data = &fragment_buffer[0];
-// 						}
-
-						if (opcode == 1 && !is_valid_utf8((unsigned char *)data, length))
-						{
-							force_close(user);
-							return true;
-						}
-						if (cfg_.on_message)
-						{
-							cfg_.on_message(this->shared_from_this(), boost::string_ref(data, length), (opcode_t)opcode);
-						}
-						if (is_closed() || is_shutting_down())
-						{
-							return true;
-						}
-						fragment_buffer.clear();
+						return finish_fragments(opcode, user);
 					}
 				}
 			}
@@ -403,6 +1256,7 @@ namespace timax
 						}
 						else if (opcode == PONG)
 						{
+							awaiting_pong_ = false;
 							if (cfg_.on_pong)
 							{
 								cfg_.on_pong(this->shared_from_this(), boost::string_ref(control_buffer));
@@ -420,37 +1274,141 @@ namespace timax
 			return false;
 		}
 
-		std::vector<boost::asio::const_buffer> websocket_connection::format_message(
-			const char *src, size_t length, opcode_t opCode/*, size_t reportedLength, bool compressed*/)
+		bool websocket_connection::finish_fragments(int opcode, void *user)
+		{
+			char *data = &fragment_buffer[0];
+			std::size_t length = fragment_buffer.length();
+			auto owner = &fragment_buffer;
+			bool valid = true;
+			if (compressed_message_)
+			{
+				if (!inflate_message(data, length))
+				{
+					force_close(user);
+					return true;
+				}
+				owner = &inflate_buffer_;
+				valid = opcode != 1 || is_valid_utf8((unsigned char *)data, length);
+			}
+			else if (opcode == 1)
+			{
+				valid = utf8_.finish();
+			}
+
+			if (!valid)
+			{
+				force_close(user);
+				return true;
+			}
+			if (deliver_message(data, length, opcode, owner))
+			{
+				return true;
+			}
+			fragment_buffer.clear();
+			return false;
+		}
+
+		bool websocket_connection::deliver_message(char *data, std::size_t length, int opcode, std::string *owner)
+		{
+			auto self = this->shared_from_this();
+			bool to_workers = cfg_.dispatch_to_workers && (cfg_.on_message_owned || cfg_.on_message);
+			if (cfg_.on_message_owned || to_workers)
+			{
+				// Ϣʱֱӽȥ
+				auto message = boost::make_shared<std::string>();
+				if (owner && owner->data() == data && owner->size() == length)
+				{
+					message->swap(*owner);
+				}
+				else
+				{
+					message->assign(data, length);
+				}
+
+				if (to_workers)
+				{
+					dispatch_message(std::move(message), opcode);
+				}
+				else
+				{
+					cfg_.on_message_owned(self, std::move(message), (opcode_t)opcode);
+				}
+			}
+			else if (cfg_.on_message)
+			{
+				cfg_.on_message(self, boost::string_ref(data, length), (opcode_t)opcode);
+			}
+			return is_closed() || is_shutting_down();
+		}
+
+		void websocket_connection::dispatch_message(boost::shared_ptr<std::string> message, int opcode)
+		{
+			if (!worker_strand_)
+			{
+				worker_strand_ = worker_pool::instance().make_strand();
+			}
+
+			auto size = message->size();
+			pending_bytes_ += size;
+			auto self = this->shared_from_this();
+			worker_strand_->post([self, this, message, opcode, size]
+			{
+				if (cfg_.on_message_owned)
+				{
+					cfg_.on_message_owned(self, message, (opcode_t)opcode);
+				}
+				else
+				{
+					cfg_.on_message(self, boost::string_ref(*message), (opcode_t)opcode);
+				}
+
+				// صio̼߳, һټ
+				run_in_io([this, size]
+				{
+					pending_bytes_ -= size;
+					if (read_paused_ && pending_bytes_ <= max_pending_bytes() / 2)
+					{
+						read_paused_ = false;
+						if (!is_closed())
+						{
+							start();
+						}
+					}
+				});
+			});
+		}
+
+		std::size_t websocket_connection::format_header(char *header, size_t length, opcode_t opCode, int flags)
 		{
 			size_t header_length;
 
 			if (length < 126)
 			{
 				header_length = 2;
-				msg_header_[1] = static_cast<char>(length);
+				header[1] = static_cast<char>(length);
 			}
 			else if (length <= UINT16_MAX)
 			{
 				header_length = 4;
-				msg_header_[1] = 126;
-				*((uint16_t *)&msg_header_[2]) = htons(static_cast<uint16_t>(length));
+				header[1] = 126;
+				uint16_t len = htons(static_cast<uint16_t>(length));
+				std::memcpy(&header[2], &len, 2);
 			}
 			else
 			{
 				header_length = 10;
-				msg_header_[1] = 127;
-				*((uint64_t *)&msg_header_[2]) = htobe64(length);
+				header[1] = 127;
+				uint64_t len = htobe64(length);
+				std::memcpy(&header[2], &len, 8);
 			}
 
-			int flags = 0;
-			msg_header_[0] = (flags & SND_NO_FIN ? 0 : 128)/* | (compressed ? SND_COMPRESSED : 0)*/;
+			header[0] = (flags & SND_NO_FIN ? 0 : 128) | (flags & SND_COMPRESSED ? SND_COMPRESSED : 0);
 			if (!(flags & SND_CONTINUATION))
 			{
-				msg_header_[0] |= opCode;
+				header[0] |= opCode;
 			}
 
-			return{ boost::asio::buffer(msg_header_, header_length), boost::asio::buffer(src, length) };
+			return header_length;
 		}
 
 		size_t websocket_connection::format_close_payload(char *dst, uint16_t code, char *message, size_t length)
@@ -2,11 +2,22 @@
 
 #include "request.hpp"
 #include "reply.hpp"
+#include "compression.hpp"
+#include "websocket_mask.hpp"
+#include "utf8_validator.hpp"
+#include "timing_wheel.hpp"
+#include "worker_pool.hpp"
+#include "connection_balancer.hpp"
 // #include "WebSocketProtocol.h"
 
+#include <atomic>
+#include <deque>
 #include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #ifdef _WIN32
 #define be64toh(x) ntohll(x)
@@ -31,6 +42,17 @@ namespace timax
 			PONG = 10
 		};
 
+		// Ͷδдݳhigh_watermarkʱĴʽ
+		enum slow_consumer_policy_t
+		{
+			// ر
+			slow_consumer_close,
+			// Ϣ, handlerյno_buffer_space
+			slow_consumer_drop,
+			// ͵ֱ߳low_watermark; io߳зʱ޷, ճŶ
+			slow_consumer_block
+		};
+
 		struct ws_config_t
 		{
 			boost::function<void(ws_conn_ptr_t, boost::string_ref, opcode_t)> on_message;
@@ -38,9 +60,45 @@ namespace timax
 			boost::function<void(ws_conn_ptr_t, boost::string_ref)> on_pong;
 			boost::function<void(ws_conn_ptr_t, boost::string_ref, opcode_t)> on_close;
 			boost::function<void(boost::system::error_code const&)> on_error;
+			// high_watermarkֽlow_watermarkʱ
+			boost::function<void(ws_conn_ptr_t)> on_drain;
+			// úon_message, ϢĻû. ϢֱӶ, ٸ
+			boost::function<void(ws_conn_ptr_t, boost::shared_ptr<std::string>, opcode_t)> on_message_owned;
+
+			// 0ʾĬֵ, 16M1M
+			std::size_t high_watermark;
+			std::size_t low_watermark;
+			slow_consumer_policy_t slow_consumer;
+			// ϢСʱƬ, Ƭ֮Բping/pong. 0Ƭ
+			std::size_t fragment_size;
+
+			// permessage-deflate(RFC 7692), ͻʱ
+			bool permessage_deflate;
+			// ͷѹ9~15, 0Ϊ13. ÿӵѹڴԼΪ2 << (bits + 2)ֽ
+			int deflate_window_bits;
+			// ÿϢѹ, ѹʵһЩ, ֮ǰϢ
+			bool deflate_no_context_takeover;
+
+			// µλΪ
+			// ôûյʱping, 0
+			int ping_interval;
+			// pingôûpongͶϿ, 0ping_intervalͬ
+			int pong_timeout;
+			// ôûյݾͷclose, 0
+			int idle_timeout;
+			// closeȴԷرյʱ, 0Ϊ5
+			int close_timeout;
+
+			// worker_poolеon_message/on_message_owned, ռio߳. ͬһӵϢյ˳
+			// , Ტ; on_closeҲ֮ǰϢ. ظճasync_send_msg
+			bool dispatch_to_workers;
+			// workerûϢôֽʱͣ, 0Ϊ16M
+			std::size_t max_pending_bytes;
 		};
 
 		using async_write_msg_callback_t = boost::function<void(boost::system::error_code const&)>;
+		// Ϣһдchunk, falseʾһ
+		using stream_producer_t = boost::function<bool(std::string& chunk)>;
 		using async_send_close_callback_t = async_write_msg_callback_t;
 		class websocket_connection : public boost::enable_shared_from_this<websocket_connection>
 		{
@@ -63,10 +121,31 @@ namespace timax
 				async_send_msg(text.data(), text.size(), opCode, std::move(handler));
 			}
 
+			// κ̵߳, datahandlerǰЧ(֡, Ḵһ).
+			// Ϣ˳򷢳, ֡(ping/pong)嵽ûд֡ǰ
 			void async_send_msg(const char* data, std::size_t length, opcode_t opCode, async_write_msg_callback_t handler);
 
+			// payloadɶ鲻ڴ, ƴ
+			void async_send_msg(std::vector<boost::asio::const_buffer> buffers, opcode_t opCode, async_write_msg_callback_t handler);
+
+			// ʽһϢ, ÿΪһƬ. producerio߳е,
+			// һдȡһ, ڼϢں
+			void async_send_stream(opcode_t opCode, stream_producer_t producer, async_write_msg_callback_t handler);
+
+			// ύûдֽ֡
+			std::size_t buffered_amount();
+
+			// һõ֡, Է(hub)
+			static boost::shared_ptr<std::string const> make_frame(const char* data, std::size_t length, opcode_t opCode);
+			// make_frameĽ, async_send_msgͬŶӺ
+			void async_send_frame(boost::shared_ptr<std::string const> frame, opcode_t opCode, async_write_msg_callback_t handler);
+
 			void close(int code, char *message, size_t length);
 
+			// ǨƵһio_service, ڵio߳е(connection_balancer).
+			// δɵдֱӶĴ֡workerеϢѾʼcloseʱfalse; TLSӲǨ
+			bool migrate(boost::asio::io_service& to);
+
 		private:
 			enum state_t
 			{
@@ -96,18 +175,44 @@ namespace timax
 			static inline bool is_fin(frame_format_t &frame) { return (frame & 128) != 0; }
 			static inline bool refuse_payload_length(void *user, std::size_t length) { return length > 16777216; }
 
-			static void unmask_imprecise(char *dst, char *src, char *mask, std::size_t length);
-			static void unmask_imprecise_copy_mask(char *dst, char *src, char *maskPtr, std::size_t length);
-			static void unmask_inplace(char *data, char *stop, char *mask);
 			static void rotate_mask(unsigned int offset, char *mask);
 			static close_frame_t parse_close_payload(char *src, size_t length);
 
 
-			bool set_compressed(void *user) { return false; }	//TODO:gzip֧
+			// RSV1ֻܳϢĵһ֡, ҪЭ̹permessage-deflate
+			bool set_compressed(frame_format_t frame)
+			{
+				if (!deflate_.enabled || get_opcode(frame) == 0 || get_opcode(frame) > 2)
+				{
+					return false;
+				}
+				compressed_message_ = true;
+				return true;
+			}
 			void force_close(void *user) { conn_->close(); }	//TODO: close connection
 
+			void on_read(boost::system::error_code const& ec, std::size_t length);
 			void consume(char *src, std::size_t length, void *user);
 
+			void join_balancer();
+
+			// ӵǰڵioִ߳. ǨǰͶݵio_serviceϵ, ִʱתµ
+			template<typename Handler>
+			void run_in_io(Handler handler)
+			{
+				auto self = this->shared_from_this();
+				auto ios = &conn_->get_io_service();
+				ios->dispatch([self, this, ios, handler]() mutable
+				{
+					if (&conn_->get_io_service() != ios)
+					{
+						run_in_io(std::move(handler));
+						return;
+					}
+					handler();
+				});
+			}
+
 			template <const int MESSAGE_HEADER, typename T>
 			inline bool consume_message(T pay_length, char *&src, std::size_t &length, frame_format_t frame, void *user)
 			{
@@ -135,8 +240,10 @@ namespace timax
 
 				if (int(pay_length) <= int(length - MESSAGE_HEADER))
 				{
-					
-					unmask_imprecise_copy_mask(src, src + MESSAGE_HEADER, src + MESSAGE_HEADER - 4, static_cast<std::size_t>(pay_length));
+					// mask֡ͷ, ᱻŲpayload
+					char frame_mask[4];
+					std::memcpy(frame_mask, src + MESSAGE_HEADER - 4, 4);
+					unmask(src, src + MESSAGE_HEADER, static_cast<std::size_t>(pay_length), frame_mask);
 					if (handle_fragment(src, static_cast<std::size_t>(pay_length), 0, opcode[(unsigned char)op_stack], is_fin(frame), user))
 					{
 						return true;
@@ -159,9 +266,13 @@ namespace timax
 					remaining_bytes = static_cast<std::size_t>(pay_length - length + MESSAGE_HEADER);
 
 					memcpy(mask, src + MESSAGE_HEADER - 4, 4);
-					unmask_imprecise(src, src + MESSAGE_HEADER, mask, length);
+					unmask(src, src + MESSAGE_HEADER, length - MESSAGE_HEADER, mask);
 					rotate_mask(4 - (length - MESSAGE_HEADER) % 4, mask);
-					handle_fragment(src, length - MESSAGE_HEADER, remaining_bytes, opcode[(unsigned char)op_stack], is_fin(frame), user);
+					if (!handle_fragment(src, length - MESSAGE_HEADER, remaining_bytes, opcode[(unsigned char)op_stack], is_fin(frame), user)
+						&& opcode[(unsigned char)op_stack] < 3 && remaining_bytes >= DIRECT_READ_SIZE)
+					{
+						read_payload(user);
+					}
 					return true;
 				}
 			}
@@ -169,8 +280,66 @@ namespace timax
 			bool consume_continuation(char *&src, std::size_t &length, void *user);
 
 			bool handle_fragment(char *data, size_t length, std::size_t remaining_bytes, int opcode, bool fin, void *user);
+			bool finish_fragments(int opcode, void *user);
+			bool deliver_message(char *data, std::size_t length, int opcode, std::string *owner);
+			void dispatch_message(boost::shared_ptr<std::string> message, int opcode);
+
+			std::size_t max_pending_bytes() const
+			{
+				return cfg_.max_pending_bytes ? cfg_.max_pending_bytes : 16 * 1024 * 1024;
+			}
+
+			// ֡ʣµpayloadֱӶfragment_bufferĩβ
+			void read_payload(void *user);
+			void adapt_buffer(std::size_t read_length);
+
+			// ping/pong/idle޹ҵʱ, ֻio߳е
+			void arm_timer();
+			void schedule_timer(uint64_t delay_ms);
+			void on_timer();
 
-			std::vector<boost::asio::const_buffer> format_message(const char *src, size_t length, opcode_t opcode/*, size_t reportedLength, bool compressed*/);
+			// ŶӵϢ, дʱһ֡
+			struct send_frame_t
+			{
+				opcode_t opcode;
+				char header[10];
+				std::size_t header_length = 0;
+				// payloadȡdata, chain, ownedвΪյ
+				const char* data = nullptr;
+				std::size_t length = 0;
+				// buffered_ֽ, ѹlength
+				std::size_t accounted = 0;
+				// ֡, һλѹpayload
+				std::string owned;
+				std::vector<boost::asio::const_buffer> chain;
+				// dataѾ֡, ӹ(hub)
+				bool framed = false;
+				boost::shared_ptr<std::string const> shared;
+				stream_producer_t producer;
+				// Ѿ˷Ƭ
+				bool started = false;
+				std::size_t sent = 0;
+				async_write_msg_callback_t handler;
+			};
+
+			static std::size_t format_header(char *header, size_t length, opcode_t opcode, int flags = 0);
+
+			struct deflate_params_t
+			{
+				bool enabled = false;
+				int server_window_bits = 15;
+				int client_window_bits = 15;
+				bool server_no_context_takeover = false;
+				bool client_no_context_takeover = false;
+			};
+
+			static bool negotiate_deflate(boost::string_ref offers, ws_config_t const& cfg, deflate_params_t& params, std::string& response);
+			bool inflate_message(char *&data, std::size_t &length);
+			bool deflate_frame(send_frame_t& frame, bool first, bool fin);
+
+			void send_frame(send_frame_t frame);
+			void queue_frame(send_frame_t frame);
+			void flush_send_queue();
 
 
 			static size_t format_close_payload(char *dst, uint16_t code, char *message, size_t length);
@@ -191,6 +360,32 @@ namespace timax
 			static const int MEDIUM_MESSAGE_HEADER = 8;
 			static const int LONG_MESSAGE_HEADER = 14;
 
+			// ջΧڵ
+			static const std::size_t MIN_RECEIVE_BUFFER = 8192;
+			static const std::size_t MAX_RECEIVE_BUFFER = 256 * 1024;
+			// ֡ʣµpayloadСʱջ
+			static const std::size_t DIRECT_READ_SIZE = 64 * 1024;
+			// ôֻõ1/4ʱ
+			static const int SHRINK_AFTER_READS = 64;
+			int small_reads_ = 0;
+			bool reading_payload_ = false;
+
+			// һʱʱ, ʱ䶼timing_wheel::now()
+			timing_wheel::handle_t timer_;
+			uint64_t last_read_ = 0;
+			uint64_t ping_sent_ = 0;
+			bool awaiting_pong_ = false;
+
+			// dispatch_to_workersʱһϢŴ
+			boost::shared_ptr<boost::asio::io_service::strand> worker_strand_;
+			// workerûֽ, ֻio߳޸
+			std::size_t pending_bytes_ = 0;
+			bool read_paused_ = false;
+
+			connection_balancer::handle_t balancer_;
+			// Ѿµio_service, ȾɵĶصת
+			bool migrating_ = false;
+
 			// this can hold two states (1 bit)
 			// this can hold length of spill (up to 16 = 4 bit)
 			unsigned char state = READ_HEAD;
@@ -202,12 +397,35 @@ namespace timax
 			char mask[4];
 			opcode_t opcode[2];
 
-			char msg_header_[10];
+			// Ͷֻio߳޸
+			std::deque<send_frame_t> control_queue_;
+			std::deque<send_frame_t> data_queue_;
+			bool writing_ = false;
+
+			// buffered_ڷ͵߳, Ҫ
+			boost::mutex send_mutex_;
+			boost::condition_variable drained_;
+			std::size_t buffered_ = 0;
+			bool above_high_watermark_ = false;
+			bool send_failed_ = false;
+			boost::thread::id io_thread_;
+
+			deflate_params_t deflate_;
+			bool compressed_message_ = false;
+			// һõʱŴ
+			boost::shared_ptr<compression::deflate_stream> deflater_;
+			boost::shared_ptr<compression::inflate_stream> inflater_;
+			// ڷ͵ϢǷѹ, ɵһƬ
+			bool deflating_ = false;
+			std::string inflate_buffer_;
 
 			std::string fragment_buffer;
+			// ƬıϢյһУһ
+			utf8_validator utf8_;
 			std::string control_buffer;
 
-			bool shutting_down = false;
+			// close()ڹ߳е, io̺߳ͷ̲߳
+			std::atomic<bool> shutting_down{ false };
 
 			ws_config_t cfg_;
 		};
@@ -0,0 +1,125 @@
+#include "websocket_hub.hpp"
+
+#include <boost/thread/locks.hpp>
+
+#include <vector>
+
+namespace timax
+{
+	namespace websocket
+	{
+		void hub::subscribe(ws_conn_ptr_t const& conn, std::string const& topic)
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+			topics_[topic][conn.get()] = conn;
+		}
+
+		void hub::unsubscribe(ws_conn_ptr_t const& conn, std::string const& topic)
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+			auto it = topics_.find(topic);
+			if (it == topics_.end())
+			{
+				return;
+			}
+
+			it->second.erase(conn.get());
+			if (it->second.empty())
+			{
+				topics_.erase(it);
+			}
+		}
+
+		void hub::unsubscribe_all(ws_conn_ptr_t const& conn)
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+			for (auto it = topics_.begin(); it != topics_.end();)
+			{
+				it->second.erase(conn.get());
+				if (it->second.empty())
+				{
+					it = topics_.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+
+		std::size_t hub::publish(std::string const& topic, boost::string_ref msg, opcode_t opcode)
+		{
+			// 先在读锁下复制订阅者, 发送时不持有锁, 回调里可以再订阅或退订
+			std::vector<boost::weak_ptr<websocket_connection>> targets;
+			{
+				boost::shared_lock<boost::shared_mutex> lock(mutex_);
+				auto it = topics_.find(topic);
+				if (it == topics_.end())
+				{
+					return 0;
+				}
+
+				targets.reserve(it->second.size());
+				for (auto const& sub : it->second)
+				{
+					targets.push_back(sub.second);
+				}
+			}
+
+			auto frame = websocket_connection::make_frame(msg.data(), msg.size(), opcode);
+			std::size_t sent = 0;
+			bool expired = false;
+			for (auto const& weak : targets)
+			{
+				auto conn = weak.lock();
+				if (!conn)
+				{
+					expired = true;
+					continue;
+				}
+
+				conn->async_send_frame(frame, opcode, {});
+				++sent;
+			}
+
+			if (expired)
+			{
+				remove_expired(topic);
+			}
+			return sent;
+		}
+
+		std::size_t hub::subscribers(std::string const& topic)
+		{
+			boost::shared_lock<boost::shared_mutex> lock(mutex_);
+			auto it = topics_.find(topic);
+			return it == topics_.end() ? 0 : it->second.size();
+		}
+
+		void hub::remove_expired(std::string const& topic)
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+			auto it = topics_.find(topic);
+			if (it == topics_.end())
+			{
+				return;
+			}
+
+			for (auto sub = it->second.begin(); sub != it->second.end();)
+			{
+				if (sub->second.expired())
+				{
+					sub = it->second.erase(sub);
+				}
+				else
+				{
+					++sub;
+				}
+			}
+			if (it->second.empty())
+			{
+				topics_.erase(it);
+			}
+		}
+	}
+}
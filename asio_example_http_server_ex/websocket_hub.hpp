@@ -0,0 +1,40 @@
+#pragma once
+
+#include "websocket.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <string>
+#include <unordered_map>
+
+namespace timax
+{
+	namespace websocket
+	{
+		// 按topic订阅的广播: publish只组一次帧, 所有订阅者共用同一块内存,
+		// 每个连接在自己的io_service中排队发送. 连接断开后自动退订
+		class hub
+			: private boost::noncopyable
+		{
+		public:
+			void subscribe(ws_conn_ptr_t const& conn, std::string const& topic);
+			void unsubscribe(ws_conn_ptr_t const& conn, std::string const& topic);
+			void unsubscribe_all(ws_conn_ptr_t const& conn);
+
+			// 返回发给了多少个连接. 订阅者的slow_consumer为block时, publish可能被最慢的连接阻塞
+			std::size_t publish(std::string const& topic, boost::string_ref msg, opcode_t opcode = TEXT);
+
+			std::size_t subscribers(std::string const& topic);
+
+		private:
+			using subscribers_t = std::unordered_map<websocket_connection const*, boost::weak_ptr<websocket_connection>>;
+
+			void remove_expired(std::string const& topic);
+
+			boost::shared_mutex mutex_;
+			std::unordered_map<std::string, subscribers_t> topics_;
+		};
+	}
+}
@@ -0,0 +1,139 @@
+#include "websocket_mask.hpp"
+#include "cpu_features.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace timax
+{
+	namespace websocket
+	{
+		namespace
+		{
+			using kernel_t = void(*)(char *, const char *, std::size_t, const char *);
+
+			// 短于这个长度时用64位的实现, 不值得对齐
+			const std::size_t min_simd_length = 64;
+
+			inline void unmask_bytes(char *dst, const char *src, std::size_t length, const char *mask)
+			{
+				for (std::size_t i = 0; i < length; ++i)
+				{
+					dst[i] = src[i] ^ mask[i & 3];
+				}
+			}
+
+			// 处理完offset个字节后, 下一个字节对应的mask
+			inline void rotated_mask(const char *mask, std::size_t offset, char *out)
+			{
+				for (std::size_t i = 0; i < 4; ++i)
+				{
+					out[i] = mask[(offset + i) & 3];
+				}
+			}
+
+			// 每次一个uint64_t, memcpy避免对齐和aliasing问题, 编译器会生成普通的load/store
+			void unmask_word(char *dst, const char *src, std::size_t length, const char *mask)
+			{
+				char pattern[8] = { mask[0], mask[1], mask[2], mask[3], mask[0], mask[1], mask[2], mask[3] };
+				uint64_t mask64;
+				std::memcpy(&mask64, pattern, sizeof(mask64));
+
+				std::size_t i = 0;
+				for (; i + 8 <= length; i += 8)
+				{
+					uint64_t v;
+					std::memcpy(&v, src + i, sizeof(v));
+					v ^= mask64;
+					std::memcpy(dst + i, &v, sizeof(v));
+				}
+				unmask_bytes(dst + i, src + i, length - i, mask);
+			}
+
+#ifdef TIMAX_X86_SIMD
+			// 先逐字处理到dst按16字节对齐, 之后src非对齐读, dst对齐写.
+			// 每次先读后写, dst <= src时不会覆盖还没读的数据
+			void unmask_sse2(char *dst, const char *src, std::size_t length, const char *mask)
+			{
+				std::size_t head = std::min<std::size_t>(length, (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15);
+				unmask_bytes(dst, src, head, mask);
+
+				char m[4];
+				rotated_mask(mask, head, m);
+				int32_t m32;
+				std::memcpy(&m32, m, sizeof(m32));
+				auto vmask = _mm_set1_epi32(m32);
+
+				std::size_t i = head;
+				for (; i + 16 <= length; i += 16)
+				{
+					auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+					_mm_store_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(v, vmask));
+				}
+				unmask_bytes(dst + i, src + i, length - i, m);
+			}
+
+			TIMAX_TARGET_AVX2 void unmask_avx2(char *dst, const char *src, std::size_t length, const char *mask)
+			{
+				std::size_t head = std::min<std::size_t>(length, (32 - (reinterpret_cast<uintptr_t>(dst) & 31)) & 31);
+				unmask_bytes(dst, src, head, mask);
+
+				char m[4];
+				rotated_mask(mask, head, m);
+				int32_t m32;
+				std::memcpy(&m32, m, sizeof(m32));
+				auto vmask = _mm256_set1_epi32(m32);
+
+				std::size_t i = head;
+				for (; i + 32 <= length; i += 32)
+				{
+					auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+					_mm256_store_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(v, vmask));
+				}
+				unmask_bytes(dst + i, src + i, length - i, m);
+			}
+#endif
+
+			struct dispatch_t
+			{
+				kernel_t kernel;
+				const char* name;
+			};
+
+			dispatch_t select_kernel()
+			{
+#ifdef TIMAX_X86_SIMD
+				if (cpu::has_avx2())
+				{
+					return{ unmask_avx2, "avx2" };
+				}
+				return{ unmask_sse2, "sse2" };
+#else
+				return{ unmask_word, "word" };
+#endif
+			}
+
+			dispatch_t const& dispatch()
+			{
+				static const dispatch_t selected = select_kernel();
+				return selected;
+			}
+		}
+
+		void unmask(char *dst, const char *src, std::size_t length, const char *mask)
+		{
+			if (length < min_simd_length)
+			{
+				unmask_word(dst, src, length, mask);
+				return;
+			}
+			dispatch().kernel(dst, src, length, mask);
+		}
+
+		const char* unmask_kernel()
+		{
+			return dispatch().name;
+		}
+	}
+}
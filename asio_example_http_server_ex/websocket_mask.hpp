@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+namespace timax
+{
+	namespace websocket
+	{
+		// dst[i] = src[i] ^ mask[i % 4], 运行时按CPU选择AVX2, SSE2或64位的实现.
+		// dst可以等于src, 也可以在src之前(去掉帧头时把payload往前挪). 只读写length个字节
+		void unmask(char *dst, const char *src, std::size_t length, const char *mask);
+
+		// 当前使用的实现: "avx2", "sse2"或"word"
+		const char* unmask_kernel();
+	}
+}
@@ -0,0 +1,59 @@
+#include "worker_pool.hpp"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace timax
+{
+	worker_pool& worker_pool::instance()
+	{
+		// never destroyed, the threads run until the process exits
+		static worker_pool* pool = new worker_pool;
+		return *pool;
+	}
+
+	worker_pool::worker_pool()
+		: work_(new boost::asio::io_service::work(io_service_))
+	{
+	}
+
+	void worker_pool::set_threads(std::size_t threads)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (!started_)
+		{
+			threads_ = threads;
+		}
+	}
+
+	boost::shared_ptr<boost::asio::io_service::strand> worker_pool::make_strand()
+	{
+		start();
+		return boost::make_shared<boost::asio::io_service::strand>(io_service_);
+	}
+
+	void worker_pool::start()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		if (started_)
+		{
+			return;
+		}
+
+		started_ = true;
+		auto threads = threads_;
+		if (threads == 0)
+		{
+			threads = boost::thread::hardware_concurrency();
+		}
+		if (threads == 0)
+		{
+			threads = 4;
+		}
+		for (std::size_t i = 0; i < threads; ++i)
+		{
+			boost::thread([this] { io_service_.run(); }).detach();
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstdint>
+
+namespace timax
+{
+	/// Threads for CPU-heavy request handling, kept apart from blocking_io_pool so slow
+	/// handlers do not hold up disk reads. Handlers that must run one at a time in order
+	/// go through a strand made by make_strand.
+	class worker_pool
+		: private boost::noncopyable
+	{
+	public:
+		static worker_pool& instance();
+
+		/// Set before serving, the threads are started on first use.
+		/// 0 means one thread per hardware thread.
+		void set_threads(std::size_t threads);
+
+		/// Handlers posted through the same strand never run concurrently and run in posting order.
+		boost::shared_ptr<boost::asio::io_service::strand> make_strand();
+
+		/// Run handler on one of the pool threads.
+		template<typename Handler>
+		void post(Handler handler)
+		{
+			start();
+			io_service_.post(std::move(handler));
+		}
+
+	private:
+		worker_pool();
+
+		void start();
+
+		boost::asio::io_service io_service_;
+		boost::shared_ptr<boost::asio::io_service::work> work_;
+
+		boost::mutex mutex_;
+		bool started_ = false;
+		std::size_t threads_ = 0;
+	};
+}
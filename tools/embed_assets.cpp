@@ -0,0 +1,239 @@
+// Pack a directory into a C++ source file served by timax::embedded_assets.
+// usage: embed_assets <directory> <output.cpp>
+
+#include "../asio_example_http_server_ex/embedded_assets.hpp"
+#include "../asio_example_http_server_ex/mime_types.hpp"
+#include "../asio_example_http_server_ex/perfect_hash.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace
+{
+	struct asset_t
+	{
+		std::string path;
+		std::string content_type;
+		std::string data;
+		std::string gzip_data;
+	};
+
+	bool read_file(boost::filesystem::path const& path, std::string& data)
+	{
+		std::ifstream ifs(path.string(), std::ios::binary);
+		if (!ifs)
+		{
+			return false;
+		}
+
+		std::ostringstream oss;
+		oss << ifs.rdbuf();
+		data = oss.str();
+		return true;
+	}
+
+	bool gzip(std::string const& data, std::string& out)
+	{
+		z_stream zs = {};
+		if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return false;
+		}
+
+		out.resize(deflateBound(&zs, static_cast<uLong>(data.size())));
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		zs.avail_in = static_cast<uInt>(data.size());
+		zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+		zs.avail_out = static_cast<uInt>(out.size());
+		auto ret = deflate(&zs, Z_FINISH);
+		out.resize(zs.total_out);
+		deflateEnd(&zs);
+		return ret == Z_STREAM_END;
+	}
+
+	// "crc32-size" in hex, the content is fixed at build time so a strong validator is fine
+	std::string make_etag(std::string const& data)
+	{
+		auto crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
+		char buf[64];
+		std::snprintf(buf, sizeof(buf), "\"%lx-%lx\"", static_cast<unsigned long>(crc), static_cast<unsigned long>(data.size()));
+		return buf;
+	}
+
+	std::string quote(std::string const& s)
+	{
+		std::string out = "\"";
+		for (auto c : s)
+		{
+			if (c == '"' || c == '\\')
+			{
+				out += '\\';
+				out += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) >= 0x7f)
+			{
+				char buf[8];
+				std::snprintf(buf, sizeof(buf), "\\%03o", static_cast<unsigned char>(c));
+				out += buf;
+			}
+			else
+			{
+				out += c;
+			}
+		}
+		out += '"';
+		return out;
+	}
+
+	void write_bytes(std::ostream& os, std::string const& name, std::string const& data)
+	{
+		// 空数组不合法, 多写一个0, 长度另外记录
+		os << "\t\t\tconstexpr unsigned char " << name << "[] =\n\t\t\t{";
+		for (std::size_t i = 0; i <= data.size(); ++i)
+		{
+			if (i % 24 == 0)
+			{
+				os << "\n\t\t\t\t";
+			}
+			os << (i == data.size() ? 0 : static_cast<unsigned>(static_cast<unsigned char>(data[i]))) << ',';
+		}
+		os << "\n\t\t\t};\n";
+	}
+
+	bool build_perfect_hash(std::vector<asset_t> const& assets, std::vector<int>& slots, std::vector<uint32_t>& seeds)
+	{
+		return timax::perfect_hash::build(assets.size(), [&assets](std::size_t i, uint32_t seed)
+		{
+			return timax::perfect_hash::hash(assets[i].path, seed);
+		}, seeds, slots);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		std::cerr << "usage: embed_assets <directory> <output.cpp>" << std::endl;
+		return 1;
+	}
+
+	boost::filesystem::path root(argv[1]);
+	std::vector<asset_t> assets;
+	boost::system::error_code ec;
+	if (boost::filesystem::is_directory(root, ec))
+	{
+		for (boost::filesystem::recursive_directory_iterator it(root), end; it != end; ++it)
+		{
+			if (!boost::filesystem::is_regular_file(it->path()))
+			{
+				continue;
+			}
+
+			// foo.js.gz旁边有foo.js时, 压缩版本由下面生成
+			auto ext = it->path().extension().string();
+			if ((ext == ".gz" || ext == ".br") && boost::filesystem::exists(it->path().parent_path() / it->path().stem()))
+			{
+				continue;
+			}
+
+			asset_t asset;
+			auto relative = it->path().generic_string().substr(root.generic_string().size());
+			if (relative.empty() || relative[0] != '/')
+			{
+				relative.insert(0, "/");
+			}
+			asset.path = relative;
+			asset.content_type = timax::mime_types::extension_to_type(ext).to_string();
+			if (!read_file(it->path(), asset.data))
+			{
+				std::cerr << "embed_assets: cannot read " << it->path() << std::endl;
+				return 1;
+			}
+
+			std::string compressed;
+			if (gzip(asset.data, compressed) && compressed.size() < asset.data.size() - asset.data.size() / 20)
+			{
+				asset.gzip_data = std::move(compressed);
+			}
+			assets.push_back(std::move(asset));
+		}
+	}
+
+	std::sort(assets.begin(), assets.end(), [](asset_t const& a, asset_t const& b) { return a.path < b.path; });
+
+	std::vector<int> slots;
+	std::vector<uint32_t> seeds;
+	if (!build_perfect_hash(assets, slots, seeds))
+	{
+		std::cerr << "embed_assets: no perfect hash found" << std::endl;
+		return 1;
+	}
+
+	std::ostringstream os;
+	os << "// generated by embed_assets from " << root.generic_string() << ", do not edit\n\n"
+		<< "#include \"embedded_assets.hpp\"\n\n"
+		<< "namespace timax\n{\n\tnamespace embedded_assets\n\t{\n\t\tnamespace generated\n\t\t{\n";
+
+	for (std::size_t i = 0; i < assets.size(); ++i)
+	{
+		write_bytes(os, "data_" + std::to_string(i), assets[i].data);
+		if (!assets[i].gzip_data.empty())
+		{
+			write_bytes(os, "gzip_" + std::to_string(i), assets[i].gzip_data);
+		}
+	}
+
+	os << "\n\t\t\textern const embedded_asset table[] =\n\t\t\t{\n";
+	for (auto index : slots)
+	{
+		if (index == -1)
+		{
+			os << "\t\t\t\t{ \"\", 0, \"\", nullptr, 0, \"\", \"\", nullptr, 0, nullptr, nullptr },\n";
+			continue;
+		}
+
+		auto const& a = assets[index];
+		auto id = std::to_string(index);
+		os << "\t\t\t\t{ " << quote(a.path) << ", " << a.path.size() << ", " << quote(a.content_type) << ",\n"
+			<< "\t\t\t\t\tdata_" << id << ", " << a.data.size() << ", \"" << a.data.size() << "\", " << quote(make_etag(a.data)) << ",\n";
+		if (a.gzip_data.empty())
+		{
+			os << "\t\t\t\t\tnullptr, 0, nullptr, nullptr },\n";
+		}
+		else
+		{
+			os << "\t\t\t\t\tgzip_" << id << ", " << a.gzip_data.size() << ", \"" << a.gzip_data.size() << "\", "
+				<< quote(make_etag(a.gzip_data)) << " },\n";
+		}
+	}
+	os << "\t\t\t};\n"
+		<< "\t\t\textern const std::size_t table_size = " << assets.size() << ";\n\n"
+		<< "\t\t\textern const uint32_t seeds[] = {";
+	for (std::size_t i = 0; i < seeds.size(); ++i)
+	{
+		os << (i == 0 ? " " : ", ") << seeds[i] << 'u';
+	}
+	os << " };\n"
+		<< "\t\t\textern const std::size_t seeds_size = " << seeds.size() << ";\n"
+		<< "\t\t}\n\t}\n}\n";
+
+	// 内容不变时不改写, 避免重新编译
+	std::string old;
+	if (read_file(argv[2], old) && old == os.str())
+	{
+		return 0;
+	}
+
+	std::ofstream ofs(argv[2], std::ios::binary);
+	ofs << os.str();
+	return ofs ? 0 : 1;
+}